@@ -0,0 +1,559 @@
+#ifndef __DLLCODEC__H__
+#define __DLLCODEC__H__
+
+// compression sessions on top of the windows CE compression dlls:
+//
+//   CodecLibrary lib("cecompr_nt.dll");
+//   CodecSession comp(lib, CodecLibrary::XPR, CodecLibrary::Compress);
+//   const uint8_t *out; DWORD outsize;
+//   for (...)
+//       if (!comp.convert(block, blocksize, out, outsize)) ...
+//
+// the exports are resolved once per library, a session keeps its stream
+// open for all blocks, and reuses its output buffer.
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <list>
+#include <map>
+#include <utility>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+#include "dllproc.h"
+
+typedef LPVOID (WINAPIV *FNCompressAlloc)(DWORD AllocSize);
+typedef VOID (WINAPIV *FNCompressFree)(LPVOID Address);
+
+// loads a compression dll, and binds all its codec exports.
+// the library must stay alive while sessions use it.
+class CodecLibrary {
+public:
+    enum Algorithm { LZX, XPR, CE };
+    enum Direction { Compress, Decompress };
+
+    typedef Proc<DWORD(DWORD,DWORD,FNCompressAlloc,FNCompressFree,DWORD)> OpenProc;
+    typedef Proc<DWORD(DWORD,LPVOID,DWORD,LPCVOID,DWORD)> ConvertProc;
+    typedef Proc<VOID(DWORD)> CloseProc;
+    struct streamprocs {
+        OpenProc open;
+        ConvertProc convert;
+        CloseProc close;
+
+        explicit operator bool() const { return open && convert && close; }
+    };
+    typedef Proc<DWORD(const LPBYTE,DWORD,LPBYTE,DWORD,WORD,DWORD)> CECompressProc;
+    typedef Proc<DWORD(const LPBYTE,DWORD,LPBYTE,DWORD,DWORD,WORD,DWORD)> CEDecompressProc;
+
+    explicit CodecLibrary(const char *dllname)
+        : _hDll(LoadLibrary(dllname))
+    {
+        if (_hDll!=NULLMODULE)
+            bind();
+    }
+    ~CodecLibrary()
+    {
+        if (_hDll!=NULLMODULE)
+            FreeLibrary(_hDll);
+    }
+    CodecLibrary(CodecLibrary&& lib)
+        : _hDll(lib._hDll), _ce(lib._ce), _ced(lib._ced)
+    {
+        for (int a=0 ; a<2 ; a++)
+            for (int d=0 ; d<2 ; d++)
+                _streams[a][d]= lib._streams[a][d];
+        lib._hDll= NULLMODULE;
+    }
+    CodecLibrary& operator=(CodecLibrary&& lib)
+    {
+        if (this!=&lib) {
+            if (_hDll!=NULLMODULE)
+                FreeLibrary(_hDll);
+            _hDll= lib._hDll;
+            for (int a=0 ; a<2 ; a++)
+                for (int d=0 ; d<2 ; d++)
+                    _streams[a][d]= lib._streams[a][d];
+            _ce= lib._ce;
+            _ced= lib._ced;
+            lib._hDll= NULLMODULE;
+        }
+        return *this;
+    }
+    CodecLibrary(const CodecLibrary&)=delete;
+    CodecLibrary& operator=(const CodecLibrary&)=delete;
+
+    // false when the dll could not be loaded, GetLastError tells why
+    explicit operator bool() const { return _hDll!=NULLMODULE; }
+    HMODULE handle() const { return _hDll; }
+
+    // not all dlls export all algorithms
+    bool supports(Algorithm alg, Direction dir) const
+    {
+        if (alg==CE)
+            return dir==Compress ? bool(_ce) : bool(_ced);
+        return bool(_streams[alg][dir]);
+    }
+    const streamprocs& stream(Algorithm alg, Direction dir) const { return _streams[alg][dir]; }
+    const CECompressProc& cecompress() const { return _ce; }
+    const CEDecompressProc& cedecompress() const { return _ced; }
+private:
+    void bind()
+    {
+        const char *algname[]= { "LZX", "XPR" };
+        const char *dirname[]= { "Compress", "Decompress" };
+        const char *convname[]= { "Encode", "Decode" };
+        for (int a=0 ; a<2 ; a++)
+            for (int d=0 ; d<2 ; d++) {
+                std::string prefix= std::string(algname[a])+"_"+dirname[d];
+                _streams[a][d].open.resolve(_hDll, (prefix+"Open").c_str());
+                _streams[a][d].convert.resolve(_hDll, (prefix+convname[d]).c_str());
+                _streams[a][d].close.resolve(_hDll, (prefix+"Close").c_str());
+            }
+        _ce.resolve(_hDll, "CECompress");
+        _ced.resolve(_hDll, "CEDecompress");
+    }
+
+    HMODULE _hDll;
+    streamprocs _streams[2][2];
+    CECompressProc _ce;
+    CEDecompressProc _ced;
+};
+
+// one open compression or decompression stream.
+// the output of convert is stored in a buffer owned by the session, which is
+// reused, so it is only valid until the next call.
+class CodecSession {
+public:
+    enum { CE_PAGESIZE= 4096 };
+    struct block {
+        block() : data(NULL), size(0) { }
+        block(const void *p, DWORD n) : data((const uint8_t*)p), size(n) { }
+        const uint8_t *data;
+        DWORD size;
+    };
+
+    CodecSession()
+        : _alg(CodecLibrary::LZX), _dir(CodecLibrary::Compress), _stream(0), _maxblocksize(0), _open(false)
+    {
+    }
+    // 'maxblocksize' is the largest uncompressed block
+    CodecSession(const CodecLibrary& lib, CodecLibrary::Algorithm alg, CodecLibrary::Direction dir, DWORD maxblocksize=0x2000, DWORD windowsize=0x10000)
+        : _alg(CodecLibrary::LZX), _dir(CodecLibrary::Compress), _stream(0), _maxblocksize(0), _open(false)
+    {
+        open(lib, alg, dir, maxblocksize, windowsize);
+    }
+    ~CodecSession()
+    {
+        close();
+    }
+    CodecSession(CodecSession&& s)
+        : _alg(s._alg), _dir(s._dir), _procs(s._procs), _ce(s._ce), _ced(s._ced),
+          _stream(s._stream), _maxblocksize(s._maxblocksize), _open(s._open), _buf(std::move(s._buf))
+    {
+        s._open= false;
+        s._stream= 0;
+    }
+    CodecSession& operator=(CodecSession&& s)
+    {
+        if (this!=&s) {
+            close();
+            _alg= s._alg;
+            _dir= s._dir;
+            _procs= s._procs;
+            _ce= s._ce;
+            _ced= s._ced;
+            _stream= s._stream;
+            _maxblocksize= s._maxblocksize;
+            _open= s._open;
+            _buf= std::move(s._buf);
+            s._open= false;
+            s._stream= 0;
+        }
+        return *this;
+    }
+    CodecSession(const CodecSession&)=delete;
+    CodecSession& operator=(const CodecSession&)=delete;
+
+    bool open(const CodecLibrary& lib, CodecLibrary::Algorithm alg, CodecLibrary::Direction dir, DWORD maxblocksize=0x2000, DWORD windowsize=0x10000)
+    {
+        close();
+        if (!lib.supports(alg, dir))
+            return false;
+        _alg= alg;
+        _dir= dir;
+        _maxblocksize= maxblocksize;
+        if (alg==CodecLibrary::CE) {
+            // the CE codec is stateless
+            _ce= lib.cecompress();
+            _ced= lib.cedecompress();
+        }
+        else {
+            _procs= lib.stream(alg, dir);
+            _stream= _procs.open(windowsize, maxblocksize, codecalloc, codecfree, 0);
+            if (_stream==0 || _stream==0xFFFFFFFF) {
+                _stream= 0;
+                return false;
+            }
+        }
+        _open= true;
+        return true;
+    }
+    void close()
+    {
+        if (_open && _alg!=CodecLibrary::CE)
+            _procs.close(_stream);
+        _open= false;
+        _stream= 0;
+    }
+    bool isopen() const { return _open; }
+
+    // 'out' points into the session's buffer
+    bool convert(const void *in, DWORD insize, const uint8_t *&out, DWORD& outsize)
+    {
+        if (!_open)
+            return false;
+        DWORD bound= outputbound(insize);
+        if (_buf.size()<bound)
+            _buf.resize(bound);
+        outsize= convertinto(in, insize, &_buf[0], bound);
+        if (outsize==0xFFFFFFFF) {
+            outsize= 0;
+            return false;
+        }
+        out= &_buf[0];
+        return true;
+    }
+    // converts many blocks in one call, the results are stored back to back in
+    // the session's buffer. on failure 'out' holds the blocks converted so far.
+    bool convert(const std::vector<block>& in, std::vector<block>& out)
+    {
+        out.clear();
+        if (!_open)
+            return false;
+        size_t total= 0;
+        for (unsigned i=0 ; i<in.size() ; i++)
+            total += outputbound(in[i].size);
+        if (_buf.size()<total)
+            _buf.resize(total);
+
+        out.reserve(in.size());
+        size_t ofs= 0;
+        for (unsigned i=0 ; i<in.size() ; i++) {
+            DWORD bound= outputbound(in[i].size);
+            DWORD n= convertinto(in[i].data, in[i].size, &_buf[ofs], bound);
+            if (n==0xFFFFFFFF)
+                return false;
+            out.push_back(block(&_buf[ofs], n));
+            ofs += n;
+        }
+        return true;
+    }
+private:
+    // returns 0xFFFFFFFF on failure, 0 is a valid result: an empty block, or a
+    // stream which buffers the output of this block for a later one.
+    DWORD convertinto(const void *in, DWORD insize, uint8_t *out, DWORD outsize)
+    {
+        DWORD n;
+        if (_alg==CodecLibrary::CE) {
+            if (_dir==CodecLibrary::Compress)
+                n= _ce((LPBYTE)in, insize, out, outsize, 1, CE_PAGESIZE);
+            else
+                n= _ced((LPBYTE)in, insize, out, outsize, 0, 1, CE_PAGESIZE);
+        }
+        else {
+            n= _procs.convert(_stream, out, outsize, in, insize);
+        }
+        return n;
+    }
+    // the largest output one block can produce
+    DWORD outputbound(DWORD insize) const
+    {
+        if (_dir==CodecLibrary::Decompress)
+            return _maxblocksize;
+        // incompressible data grows a little
+        return insize+insize/8+64;
+    }
+
+    // the dll allocates its stream state through these
+    static DLLCALLBACK LPVOID WINAPIV codecalloc(DWORD size) { return malloc(size); }
+    static DLLCALLBACK VOID WINAPIV codecfree(LPVOID p) { free(p); }
+
+    CodecLibrary::Algorithm _alg;
+    CodecLibrary::Direction _dir;
+    CodecLibrary::streamprocs _procs;
+    CodecLibrary::CECompressProc _ce;
+    CodecLibrary::CEDecompressProc _ced;
+    DWORD _stream;
+    DWORD _maxblocksize;
+    bool _open;
+    std::vector<uint8_t> _buf;
+};
+
+// random access reads from an image which was compressed page by page with
+// CECompress, like the compressed sections of a CE rom:
+//
+//   std::vector<CEPageReader::page> index;
+//   std::vector<uint8_t> data;
+//   CEPageReader::compress(lib, image, imagesize, data, index);
+//   CEPageReader reader(lib, &data[0], index, imagesize);
+//   reader.read(ofs, buf, len);
+//
+// only the pages a read touches are decompressed. they are kept in an LRU cache,
+// and when a read misses several pages, these are decompressed by a pool of threads.
+// without a cache, partial pages are decompressed straight into the caller's buffer,
+// using the dwSkip argument of CEDecompress.
+// a reader is not thread safe, the library and the compressed data must stay alive.
+class CEPageReader {
+public:
+    // a page is stored uncompressed when it did not compress
+    struct page {
+        page() : offset(0), size(0) { }
+        page(uint64_t offset, DWORD size) : offset(offset), size(size) { }
+        uint64_t offset;
+        DWORD size;
+    };
+    struct statistics {
+        statistics() : reads(0), hits(0), misses(0), decompressed(0) { }
+        uint64_t reads;
+        uint64_t hits;          // pages found in the cache
+        uint64_t misses;        // pages decompressed
+        uint64_t decompressed;  // bytes produced by CEDecompress
+
+        double hitrate() const { return hits+misses ? double(hits)/(hits+misses) : 0; }
+        double bytesperread() const { return reads ? double(decompressed)/reads : 0; }
+    };
+
+    // compresses 'image' into 'data', with one index entry per page
+    static bool compress(const CodecLibrary& lib, const void *image, uint64_t size, std::vector<uint8_t>& data, std::vector<page>& index, DWORD pagesize=CodecSession::CE_PAGESIZE)
+    {
+        if (!lib.cecompress())
+            return false;
+        const uint8_t *p= (const uint8_t*)image;
+        data.clear();
+        index.clear();
+        std::vector<uint8_t> buf(pagesize);
+        for (uint64_t ofs=0 ; ofs<size ; ofs+=pagesize) {
+            DWORD len= DWORD(std::min(uint64_t(pagesize), size-ofs));
+            // only keep the compressed page when it is smaller
+            DWORD n= len>1 ? lib.cecompress()((LPBYTE)p+ofs, len, &buf[0], len-1, 1, pagesize) : 0xFFFFFFFF;
+            index.push_back(page(data.size(), n==0 || n==0xFFFFFFFF ? len : n));
+            if (n==0 || n==0xFFFFFFFF)
+                data.insert(data.end(), p+ofs, p+ofs+len);
+            else
+                data.insert(data.end(), &buf[0], &buf[n]);
+        }
+        return true;
+    }
+
+    // 'cachepages' 0 disables the cache, 'threads' 0 decompresses everything on the calling thread
+    CEPageReader(const CodecLibrary& lib, const uint8_t *data, const std::vector<page>& index, uint64_t imagesize,
+            unsigned cachepages=256, unsigned threads=4, DWORD pagesize=CodecSession::CE_PAGESIZE)
+        : _ced(lib.cedecompress()), _data(data), _index(index), _imagesize(imagesize), _pagesize(pagesize),
+          _cachepages(cachepages), _stop(false), _generation(0), _busy(0), _jobs(NULL), _next(0), _failed(false)
+    {
+        for (unsigned i=0 ; i<threads ; i++)
+            _workers.push_back(std::thread(&CEPageReader::worker, this));
+    }
+    ~CEPageReader()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mtx);
+            _stop= true;
+        }
+        _wake.notify_all();
+        for (unsigned i=0 ; i<_workers.size() ; i++)
+            _workers[i].join();
+    }
+    CEPageReader(const CEPageReader&)=delete;
+    CEPageReader& operator=(const CEPageReader&)=delete;
+
+    uint64_t size() const { return _imagesize; }
+    const statistics& stats() const { return _stats; }
+
+    // fails for reads past the end of the image, or when a page does not decompress
+    bool read(uint64_t ofs, void *buf, size_t len)
+    {
+        if (!_ced || ofs>_imagesize || len>_imagesize-ofs)
+            return false;
+        _stats.reads++;
+        if (len==0)
+            return true;
+        uint8_t *out= (uint8_t*)buf;
+        uint64_t first= ofs/_pagesize;
+        uint64_t last= (ofs+len-1)/_pagesize;
+
+        // pages found in the cache are copied right away, the others after decompressing
+        std::vector<job> jobs;
+        std::vector<cachedpage> fresh;
+        fresh.reserve(last-first+1);
+        for (uint64_t pg=first ; pg<=last ; pg++) {
+            uint64_t pagestart= pg*_pagesize;
+            DWORD skip= DWORD(std::max(ofs, pagestart)-pagestart);
+            DWORD n= DWORD(std::min(ofs+len, pagestart+pagelength(pg))-pagestart-skip);
+            uint8_t *dest= out+(pagestart+skip-ofs);
+            if (_cachepages) {
+                const std::vector<uint8_t> *cached= lookup(pg);
+                if (cached) {
+                    memcpy(dest, &(*cached)[skip], n);
+                    _stats.hits++;
+                    continue;
+                }
+                fresh.push_back(cachedpage(pg, std::vector<uint8_t>(pagelength(pg))));
+                jobs.push_back(job(pg, &fresh.back().data[0], 0, pagelength(pg)));
+            }
+            else {
+                jobs.push_back(job(pg, dest, skip, n));
+            }
+            _stats.misses++;
+        }
+        if (!decompress(jobs))
+            return false;
+
+        for (unsigned i=0 ; i<fresh.size() ; i++) {
+            uint64_t pagestart= fresh[i].pageno*_pagesize;
+            DWORD skip= DWORD(std::max(ofs, pagestart)-pagestart);
+            DWORD n= DWORD(std::min(ofs+len, pagestart+pagelength(fresh[i].pageno))-pagestart-skip);
+            memcpy(out+(pagestart+skip-ofs), &fresh[i].data[skip], n);
+            insert(fresh[i]);
+        }
+        return true;
+    }
+private:
+    struct cachedpage {
+        cachedpage(uint64_t pageno, std::vector<uint8_t>&& data) : pageno(pageno), data(std::move(data)) { }
+        uint64_t pageno;
+        std::vector<uint8_t> data;
+    };
+    typedef std::list<cachedpage> pagelist;
+    typedef std::map<uint64_t,pagelist::iterator> pagemap;
+
+    // decompress 'len' bytes of page 'pageno', starting at 'skip', into 'dest'
+    struct job {
+        job(uint64_t pageno, uint8_t *dest, DWORD skip, DWORD len) : pageno(pageno), dest(dest), skip(skip), len(len) { }
+        uint64_t pageno;
+        uint8_t *dest;
+        DWORD skip;
+        DWORD len;
+    };
+
+    DWORD pagelength(uint64_t pg) const
+    {
+        return DWORD(std::min(uint64_t(_pagesize), _imagesize-pg*_pagesize));
+    }
+    const std::vector<uint8_t> *lookup(uint64_t pg)
+    {
+        pagemap::iterator i= _cache.find(pg);
+        if (i==_cache.end())
+            return NULL;
+        // move to the front of the LRU
+        _lru.splice(_lru.begin(), _lru, (*i).second);
+        return &(*(*i).second).data;
+    }
+    void insert(cachedpage& pg)
+    {
+        _lru.push_front(cachedpage(pg.pageno, std::move(pg.data)));
+        _cache[pg.pageno]= _lru.begin();
+        while (_lru.size()>_cachepages) {
+            _cache.erase(_lru.back().pageno);
+            _lru.pop_back();
+        }
+    }
+
+    bool decompressjob(const job& j)
+    {
+        if (j.pageno>=_index.size())
+            return false;
+        const page& pg= _index[j.pageno];
+        if (pg.size==pagelength(j.pageno)) {
+            // stored uncompressed
+            memcpy(j.dest, _data+pg.offset+j.skip, j.len);
+            return true;
+        }
+        DWORD n= _ced((LPBYTE)_data+pg.offset, pg.size, j.dest, j.len, j.skip, 1, _pagesize);
+        return n==j.len;
+    }
+    // runs jobs until none are left, on the workers and on the calling thread
+    void runjobs()
+    {
+        while (true) {
+            size_t i= _next++;
+            if (i>=_jobs->size())
+                break;
+            if (!decompressjob((*_jobs)[i]))
+                _failed= true;
+        }
+    }
+    bool decompress(const std::vector<job>& jobs)
+    {
+        for (unsigned i=0 ; i<jobs.size() ; i++)
+            _stats.decompressed += jobs[i].len;
+        if (jobs.size()<2 || _workers.empty()) {
+            for (unsigned i=0 ; i<jobs.size() ; i++)
+                if (!decompressjob(jobs[i]))
+                    return false;
+            return true;
+        }
+        {
+            std::lock_guard<std::mutex> lock(_mtx);
+            _jobs= &jobs;
+            _next= 0;
+            _failed= false;
+            _busy= _workers.size();
+            _generation++;
+        }
+        _wake.notify_all();
+        runjobs();
+        std::unique_lock<std::mutex> lock(_mtx);
+        while (_busy)
+            _done.wait(lock);
+        return !_failed;
+    }
+    void worker()
+    {
+        unsigned seen= 0;
+        std::unique_lock<std::mutex> lock(_mtx);
+        while (true) {
+            while (!_stop && _generation==seen)
+                _wake.wait(lock);
+            if (_stop)
+                return;
+            seen= _generation;
+            lock.unlock();
+            runjobs();
+            lock.lock();
+            if (--_busy==0)
+                _done.notify_all();
+        }
+    }
+
+    CodecLibrary::CEDecompressProc _ced;
+    const uint8_t *_data;
+    std::vector<page> _index;
+    uint64_t _imagesize;
+    DWORD _pagesize;
+
+    unsigned _cachepages;
+    pagelist _lru;
+    pagemap _cache;
+    statistics _stats;
+
+    // the decompression threads
+    std::vector<std::thread> _workers;
+    std::mutex _mtx;
+    std::condition_variable _wake;
+    std::condition_variable _done;
+    bool _stop;
+    unsigned _generation;
+    unsigned _busy;
+    const std::vector<job> *_jobs;
+    std::atomic<size_t> _next;
+    std::atomic<bool> _failed;
+};
+
+#endif
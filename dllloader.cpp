@@ -8,6 +8,7 @@
 #include <stdint.h>
 
 #include <stdio.h>
+#include <string.h>
 #ifndef _WIN32_WCE
 #include <errno.h>
 #include <sys/stat.h>
@@ -19,6 +20,8 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <list>
+#include <algorithm>
 
 #include "dllloader.h"
 
@@ -37,15 +40,54 @@ typedef uint32_t off_t;
 #endif
 
 #endif
-#ifdef __GNUC__
-#define __stdcall __attribute__((stdcall))
+#if defined(__GNUC__) && !defined(_WIN32)
+// on x86_64 both map to the windows x64 convention ( ms_abi )
+#define __stdcall WINAPI
+#define __cdecl WINAPIV
+#endif
+
+#ifndef _WIN32
+#define ALIGN_STACK  __attribute__((force_align_arg_pointer))
+#else
+#define ALIGN_STACK
 #endif
 
 #define logmsg(...)
 
-#ifdef __MACH__
+#if defined(__MACH__) || defined(__linux__)
 #include <sys/mman.h>
 #endif
+#ifndef _WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/time.h>
+#include <time.h>
+#ifdef __linux__
+#include <ucontext.h>
+#include <sys/inotify.h>
+#else
+#include <sys/ucontext.h>
+#endif
+#endif
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define HAVE_IO_URING
+#endif
+#endif
+#endif
 
 class posixerror {
 public:
@@ -80,7 +122,16 @@ class unimplemented {
 public:
     ~unimplemented() { fprintf(stderr,"ERROR: unimplemented\n"); }
 };
-unsigned g_lasterror;
+// the memory supplied by the caller cannot hold the image
+class insufficientmemory {
+public:
+    insufficientmemory(size_t needed) : _needed(needed) { }
+    size_t needed() const { return _needed; }
+private:
+    size_t _needed;
+};
+// per thread, as in windows, background loads must not clobber it
+thread_local unsigned g_lasterror;
 
 unsigned MyGetLastError()
 {
@@ -149,6 +200,54 @@ struct peheader {
     // offset=((uint8_t*)(&pe->coffmagic))+pe->opthdrsize
     // followed by o32 records
 };
+// PE32+ variant of the above, used for x64 images
+struct peheader64 {
+    char magic[4];
+    uint16_t cpu;
+    uint16_t objcnt;
+    uint32_t timestamp;
+    uint32_t symtaboff;
+
+    uint32_t symcount;
+    uint16_t opthdrsize;
+    uint16_t imageflags;
+    // here the opthdr starts.
+    uint16_t coffmagic;	//Coff magic number (0x20b)
+    uint8_t linkmajor;
+    uint8_t linkminor;
+    uint32_t codesize;
+
+    uint32_t initdsize;
+    uint32_t uninitdsize;
+    uint32_t entryrva;
+    uint32_t codebase;
+
+    uint64_t vbase;	//Virtual base address of module, no 'database' in PE32+
+    uint32_t objalign;
+    uint32_t filealign;
+
+    uint16_t osmajor;
+    uint16_t osminor;
+    uint16_t usermajor;
+    uint16_t userminor;
+    uint16_t subsysmajor;
+    uint16_t subsysminor;
+    uint32_t res1;
+
+    uint32_t vsize;
+    uint32_t hdrsize;
+    uint32_t filechksum;
+    uint16_t subsys;
+    uint16_t dllflags;
+
+    uint64_t stackmax;
+    uint64_t stackinit;
+    uint64_t heapmax;
+    uint64_t heapinit;
+
+    uint32_t res2;
+    uint32_t hdrextra;
+};
 struct pe_info {
     uint32_t offset;
     uint32_t size;
@@ -165,14 +264,29 @@ struct o32_header {
     uint32_t temp3;
     uint32_t flags;
 };
+#define IMAGE_SCN_MEM_DISCARDABLE 0x02000000
+#define IMAGE_SCN_MEM_EXECUTE   0x20000000
+#define IMAGE_SCN_MEM_READ      0x40000000
+#define IMAGE_SCN_MEM_WRITE     0x80000000
+
+// where the dll image is read from
+class imagesource {
+public:
+    virtual ~imagesource() { }
+    virtual void seek(off_t o, int whence=SEEK_SET)=0;
+    virtual void readexact(void *p, size_t n)=0;
+    virtual int readmax(void *p, size_t nmax)=0;
+    // descriptor which sections can be mmapped from, or -1
+    virtual int fd() const { return -1; }
+};
 
-class posixfile {
+class posixfile : public imagesource {
 private:
     FILE *_f;
     std::string _name;
 public:
     posixfile(const std::string& name)
-        : _f(NULL)
+        : _f(NULL), _name(name)
     {
         _f= fopen(name.c_str(), "rb");
         if (_f==NULL)
@@ -203,38 +317,444 @@ public:
             throw posixerror("fread", _name);
         return m;
     }
+#ifndef _WIN32
+    int fd() const { return fileno(_f); }
+#endif
+};
+#ifndef _WIN32
+// reads with pread, so the callers file offset is left alone
+class fdfile : public imagesource {
+private:
+    int _fd;
+    off_t _pos;
+public:
+    fdfile(int fd)
+        : _fd(dup(fd)), _pos(0)
+    {
+        if (_fd==-1)
+            throw posixerror("dup", "fd");
+    }
+    ~fdfile()
+    {
+        close(_fd);
+    }
+    void seek(off_t o, int whence=SEEK_SET)
+    {
+        if (whence==SEEK_CUR)
+            o += _pos;
+        else if (whence==SEEK_END) {
+            struct stat st;
+            if (-1==fstat(_fd, &st))
+                throw posixerror("fstat", "fd");
+            o += st.st_size;
+        }
+        _pos= o;
+    }
+    void readexact(void *p, size_t n)
+    {
+        if (size_t(readmax(p, n))!=n)
+            throw loadererror("read beyond end of file");
+    }
+    int readmax(void *p, size_t nmax)
+    {
+        size_t total= 0;
+        while (total<nmax) {
+            ssize_t m= pread(_fd, (uint8_t*)p+total, nmax-total, _pos);
+            if (m==-1 && errno==EINTR)
+                continue;
+            if (m==-1)
+                throw posixerror("pread", "fd");
+            if (m==0)
+                break;
+            total += m;
+            _pos += m;
+        }
+        return total;
+    }
+    int fd() const { return _fd; }
+};
+
+#ifdef HAVE_IO_URING
+// the minimum of io_uring needed for reading: a submission and a completion ring,
+// without liburing.
+class IoRing {
+public:
+    IoRing() : _fd(-1), _sq(MAP_FAILED), _cq(MAP_FAILED), _sqes(MAP_FAILED), _sqsize(0), _cqsize(0), _sqesize(0), _queued(0) { }
+    ~IoRing()
+    {
+        if (_sqes!=MAP_FAILED)
+            munmap(_sqes, _sqesize);
+        if (_cq!=MAP_FAILED && _cq!=_sq)
+            munmap(_cq, _cqsize);
+        if (_sq!=MAP_FAILED)
+            munmap(_sq, _sqsize);
+        if (_fd!=-1)
+            close(_fd);
+    }
+    // returns false when the kernel has no io_uring, or does not allow it
+    bool setup(unsigned entries)
+    {
+        struct io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        _fd= syscall(__NR_io_uring_setup, entries, &p);
+        if (_fd<0) {
+            _fd= -1;
+            return false;
+        }
+        _sqsize= p.sq_off.array+p.sq_entries*sizeof(unsigned);
+        _cqsize= p.cq_off.cqes+p.cq_entries*sizeof(struct io_uring_cqe);
+        if (p.features&IORING_FEAT_SINGLE_MMAP)
+            _sqsize= _cqsize= std::max(_sqsize, _cqsize);
+        _sq= mmap(NULL, _sqsize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, _fd, IORING_OFF_SQ_RING);
+        if (_sq==MAP_FAILED)
+            return false;
+        if (p.features&IORING_FEAT_SINGLE_MMAP)
+            _cq= _sq;
+        else if (MAP_FAILED==(_cq= mmap(NULL, _cqsize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, _fd, IORING_OFF_CQ_RING)))
+            return false;
+        _sqesize= p.sq_entries*sizeof(struct io_uring_sqe);
+        _sqes= mmap(NULL, _sqesize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, _fd, IORING_OFF_SQES);
+        if (_sqes==MAP_FAILED)
+            return false;
+        _sqentries= p.sq_entries;
+        _cqentries= p.cq_entries;
+        _sqhead= (unsigned*)((uint8_t*)_sq+p.sq_off.head);
+        _sqtail= (unsigned*)((uint8_t*)_sq+p.sq_off.tail);
+        _sqmask= *(unsigned*)((uint8_t*)_sq+p.sq_off.ring_mask);
+        _sqarray= (unsigned*)((uint8_t*)_sq+p.sq_off.array);
+        _cqhead= (unsigned*)((uint8_t*)_cq+p.cq_off.head);
+        _cqtail= (unsigned*)((uint8_t*)_cq+p.cq_off.tail);
+        _cqmask= *(unsigned*)((uint8_t*)_cq+p.cq_off.ring_mask);
+        _cqes= (struct io_uring_cqe*)((uint8_t*)_cq+p.cq_off.cqes);
+        return true;
+    }
+    // queues a read, returns false when the submission ring is full.
+    // 'iov' must stay valid until the read completes.
+    bool queueread(int fd, const struct iovec *iov, off_t ofs, uint64_t tag)
+    {
+        unsigned tail= *_sqtail;
+        if (tail-__atomic_load_n(_sqhead, __ATOMIC_ACQUIRE)>=_sqentries)
+            return false;
+        unsigned idx= tail&_sqmask;
+        struct io_uring_sqe *sqe= (struct io_uring_sqe*)_sqes+idx;
+        memset(sqe, 0, sizeof(*sqe));
+        // readv is in all io_uring kernels, plain read only since 5.6
+        sqe->opcode= IORING_OP_READV;
+        sqe->fd= fd;
+        sqe->addr= uintptr_t(iov);
+        sqe->len= 1;
+        sqe->off= ofs;
+        sqe->user_data= tag;
+        _sqarray[idx]= idx;
+        __atomic_store_n(_sqtail, tail+1, __ATOMIC_RELEASE);
+        _queued++;
+        return true;
+    }
+    // the completion ring holds this many, more reads in flight could overflow it
+    unsigned capacity() const { return _cqentries; }
+    // submits the queued reads, and waits until at least one has completed.
+    // returns early when the completion ring is full, the caller reaps it and retries.
+    void submitandwait()
+    {
+        // the kernel may take only part of the queue, only wait once all is submitted
+        while (_queued) {
+            int n= syscall(__NR_io_uring_enter, _fd, _queued, 0, 0, NULL, 0);
+            if (n==-1) {
+                if (errno==EBUSY)
+                    return;
+                if (errno!=EINTR && errno!=EAGAIN)
+                    throw posixerror("io_uring_enter", "sections");
+                continue;
+            }
+            _queued -= std::min(unsigned(n), _queued);
+        }
+        while (-1==syscall(__NR_io_uring_enter, _fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0)) {
+            if (errno==EBUSY)
+                return;
+            if (errno!=EINTR && errno!=EAGAIN)
+                throw posixerror("io_uring_enter", "sections");
+        }
+    }
+    // returns false when no read has completed
+    bool completion(uint64_t& tag, int& res)
+    {
+        unsigned head= *_cqhead;
+        if (head==__atomic_load_n(_cqtail, __ATOMIC_ACQUIRE))
+            return false;
+        const struct io_uring_cqe *cqe= &_cqes[head&_cqmask];
+        tag= cqe->user_data;
+        res= cqe->res;
+        __atomic_store_n(_cqhead, head+1, __ATOMIC_RELEASE);
+        return true;
+    }
+private:
+    IoRing(const IoRing&);
+    IoRing& operator=(const IoRing&);
+
+    int _fd;
+    void *_sq, *_cq, *_sqes;
+    size_t _sqsize, _cqsize, _sqesize;
+    unsigned _sqentries, _cqentries;
+    unsigned *_sqhead, *_sqtail, *_sqarray, _sqmask;
+    unsigned *_cqhead, *_cqtail, _cqmask;
+    struct io_uring_cqe *_cqes;
+    unsigned _queued;
+};
+#endif
+
+// reads a list of file ranges at once, next() returns them in the order in
+// which they arrive, so the caller can work on one while the others are read.
+// uses io_uring when available, otherwise a few threads doing pread.
+class AsyncReads {
+public:
+    struct range {
+        range(off_t fileofs, uint8_t *p, size_t len) : fileofs(fileofs), p(p), len(len) { }
+        off_t fileofs;
+        uint8_t *p;
+        size_t len;
+    };
+    enum { QUEUEDEPTH= 64, THREADS= 4 };
+
+    AsyncReads(int fd, const std::vector<range>& ranges)
+        : _fd(fd), _ranges(ranges), _completed(0), _next(0), _inflight(0), _error(0), _eof(false), _stop(false)
+    {
+        if (_ranges.empty())
+            return;
+#ifdef HAVE_IO_URING
+        if (_ring.setup(std::min(unsigned(_ranges.size()), unsigned(QUEUEDEPTH)))) {
+            _iov.resize(_ranges.size());
+            _done.resize(_ranges.size());
+            for (unsigned i=0 ; i<_ranges.size() ; i++) {
+                _iov[i].iov_base= _ranges[i].p;
+                _iov[i].iov_len= _ranges[i].len;
+            }
+            logmsg("dll:reading %d ranges with io_uring\n", _ranges.size());
+            return;
+        }
+#endif
+        for (unsigned i=0 ; i<std::min(unsigned(_ranges.size()), unsigned(THREADS)) ; i++)
+            _threads.push_back(std::thread(&AsyncReads::worker, this));
+    }
+    ~AsyncReads()
+    {
+#ifdef HAVE_IO_URING
+        // the kernel may still be writing into the image
+        try {
+            while (_inflight) {
+                uint64_t tag;
+                int res;
+                if (_ring.completion(tag, res))
+                    _inflight--;
+                else
+                    _ring.submitandwait();
+            }
+        }
+        catch(...)
+        {
+        }
+#endif
+        {
+            std::lock_guard<std::mutex> lock(_mtx);
+            _stop= true;
+        }
+        for (unsigned i=0 ; i<_threads.size() ; i++)
+            _threads[i].join();
+    }
+
+    // the index of a range which has been read completely, -1 when all are done
+    int next()
+    {
+        if (_threads.empty())
+            return nextcompletion();
+        std::unique_lock<std::mutex> lock(_mtx);
+        while (true) {
+            if (_eof)
+                throw loadererror("read beyond end of file");
+            if (_error) {
+                errno= _error;
+                throw posixerror("pread", "sections");
+            }
+            if (!_finished.empty()) {
+                unsigned i= _finished.front();
+                _finished.erase(_finished.begin());
+                _completed++;
+                return i;
+            }
+            if (_completed==_ranges.size())
+                return -1;
+            _arrived.wait(lock);
+        }
+    }
+private:
+    AsyncReads(const AsyncReads&);
+    AsyncReads& operator=(const AsyncReads&);
+
+    int nextcompletion()
+    {
+#ifdef HAVE_IO_URING
+        while (_completed<_ranges.size()) {
+            uint64_t tag;
+            int res;
+            if (_ring.completion(tag, res)) {
+                _inflight--;
+                if (res==-EINTR || res==-EAGAIN)
+                    res= 0;
+                else if (res<0) {
+                    errno= -res;
+                    throw posixerror("read", "sections");
+                }
+                else if (res==0)
+                    throw loadererror("read beyond end of file");
+                _done[tag] += res;
+                if (_done[tag]==_ranges[tag].len) {
+                    _completed++;
+                    return tag;
+                }
+                // short read, ask for the rest
+                _iov[tag].iov_base= _ranges[tag].p+_done[tag];
+                _iov[tag].iov_len= _ranges[tag].len-_done[tag];
+                _retry.push_back(tag);
+                continue;
+            }
+            while (!_retry.empty() && _inflight<_ring.capacity() && _ring.queueread(_fd, &_iov[_retry.back()], _ranges[_retry.back()].fileofs+_done[_retry.back()], _retry.back())) {
+                _retry.pop_back();
+                _inflight++;
+            }
+            while (_next<_ranges.size() && _inflight<_ring.capacity() && _ring.queueread(_fd, &_iov[_next], _ranges[_next].fileofs, _next)) {
+                _next++;
+                _inflight++;
+            }
+            _ring.submitandwait();
+        }
+#endif
+        return -1;
+    }
+    void worker()
+    {
+        while (true) {
+            unsigned i;
+            {
+                std::lock_guard<std::mutex> lock(_mtx);
+                if (_stop || _next>=_ranges.size())
+                    return;
+                i= _next++;
+            }
+            size_t total= 0;
+            int error= 0;
+            while (total<_ranges[i].len) {
+                ssize_t m= pread(_fd, _ranges[i].p+total, _ranges[i].len-total, _ranges[i].fileofs+total);
+                if (m==-1 && errno==EINTR)
+                    continue;
+                if (m<=0) {
+                    error= m==0 ? -1 : errno;
+                    break;
+                }
+                total += m;
+            }
+            std::lock_guard<std::mutex> lock(_mtx);
+            if (error==-1)
+                _eof= true;
+            else if (error)
+                _error= error;
+            else
+                _finished.push_back(i);
+            _arrived.notify_one();
+            if (error)
+                return;
+        }
+    }
+
+    int _fd;
+    std::vector<range> _ranges;
+    unsigned _completed;
+    unsigned _next;         // the first range not yet queued
+#ifdef HAVE_IO_URING
+    IoRing _ring;
+    std::vector<struct iovec> _iov;
+    std::vector<size_t> _done;
+    std::vector<unsigned> _retry;
+#endif
+    unsigned _inflight;
+
+    // the thread pool
+    std::vector<std::thread> _threads;
+    std::mutex _mtx;
+    std::condition_variable _arrived;
+    std::vector<unsigned> _finished;
+    int _error;
+    bool _eof;
+    bool _stop;
+};
+#endif
+// an image in the callers memory, which is only needed while loading
+class memoryfile : public imagesource {
+private:
+    const uint8_t *_p;
+    size_t _size;
+    size_t _pos;
+public:
+    memoryfile(const void *p, size_t size)
+        : _p((const uint8_t*)p), _size(size), _pos(0)
+    {
+    }
+    void seek(off_t o, int whence=SEEK_SET)
+    {
+        if (whence==SEEK_CUR)
+            o += _pos;
+        else if (whence==SEEK_END)
+            o += _size;
+        if (o<0 || size_t(o)>_size)
+            throw loadererror("seek beyond end of image");
+        _pos= o;
+    }
+    void readexact(void *p, size_t n)
+    {
+        if (n>_size-_pos)
+            throw loadererror("read beyond end of image");
+        readmax(p, n);
+    }
+    int readmax(void *p, size_t nmax)
+    {
+        size_t n= std::min(nmax, _size-_pos);
+        memcpy(p, _p+_pos, n);
+        _pos += n;
+        return n;
+    }
 };
 
 class PEFileInfo {
     struct sectioninfo {
-        sectioninfo() : fileoffset(0), filesize(0), virtualaddress(0), virtualsize(0) { }
+        sectioninfo() : fileoffset(0), filesize(0), virtualaddress(0), virtualsize(0), flags(0) { }
+        std::string name;
         off_t fileoffset;
         size_t filesize;
-        size_t virtualaddress;
+        uint64_t virtualaddress;
         size_t virtualsize;
+        uint32_t flags;     // IMAGE_SCN_xxx
     };
     struct exportsymbol {
         exportsymbol() : ordinal(0), virtualaddress(0) { }
         std::string name;
         unsigned ordinal;
-        unsigned virtualaddress;
+        uint64_t virtualaddress;
     };
     struct importsymbol {
         importsymbol() : ordinal(0), virtualaddress(0) { }
         std::string dllname;
         std::string name;
         unsigned ordinal;
-        unsigned virtualaddress;
+        uint64_t virtualaddress;
     };
     struct relocinfo {
         relocinfo() : virtualaddress(0), type(0) { }
-        size_t virtualaddress;
+        uint64_t virtualaddress;
         int type;
     };
 public:
-    PEFileInfo(posixfile& f)
-        : _f(f), _vbase(0), _cpu(0), _entryrva(0)
+    PEFileInfo(imagesource& f)
+        : _f(&f), _vbase(0), _cpu(0), _entryrva(0), _is64(false)
     {
+        _resources.offset= _resources.size= 0;
         f.seek(0);
         mzheader mz;
         f.readexact(&mz, sizeof(mz));
@@ -255,15 +775,29 @@ public:
 //          throw loadererror("unsupported cpu");
         _cpu= pe.cpu;
         _entryrva= pe.entryrva;
-        if (pe.coffmagic==0x20b)
-            throw loadererror("PE32+ optheader not supported");
-        if (pe.coffmagic!=0x10b)
+        uint32_t hdrextra;
+        if (pe.coffmagic==0x20b) {
+            // PE32+: reread the header with the 64 bit layout
+            peheader64 pe64;
+            f.seek(mz.lfanew);
+            f.readexact(&pe64, sizeof(pe64));
+            _vbase= pe64.vbase;
+            hdrextra= pe64.hdrextra;
+            _is64= true;
+        }
+        else if (pe.coffmagic==0x10b) {
+            _vbase= pe.vbase;
+            hdrextra= pe.hdrextra;
+        }
+        else {
             throw loadererror("invalid PE32 optheader");
-        std::vector<pe_info> info(pe.hdrextra>0x10 ? 0x10 : pe.hdrextra);
+        }
+        // missing info records are treated as empty
+        std::vector<pe_info> info(0x10);
 
-        _vbase= pe.vbase;
         // read info records
-        f.readexact(&info[0], sizeof(pe_info)*info.size());
+        if (hdrextra)
+            f.readexact(&info[0], sizeof(pe_info)*std::min(hdrextra, uint32_t(info.size())));
 
 #define PTR_DIFF(a,b)  ((uint8_t*)(&b)-(uint8_t*)(&a))
         // read o32 records
@@ -275,10 +809,12 @@ public:
         _sections.resize(pe.objcnt);
         for (unsigned i=0 ; i<pe.objcnt ; i++)
         {
+            _sections[i].name= std::string(o32[i].name, std::find(o32[i].name, o32[i].name+8, 0));
             _sections[i].fileoffset = o32[i].dataptr;
             _sections[i].filesize   = o32[i].psize;
             _sections[i].virtualaddress= _vbase+o32[i].rva;
             _sections[i].virtualsize= o32[i].vsize;
+            _sections[i].flags= o32[i].flags;
         }
 #ifndef _WIN32_WCE
 enum {
@@ -291,6 +827,8 @@ enum {
             read_import_table(info[IMP].offset, info[IMP].size);
         if (info[FIX].size)
             read_reloc_table(info[FIX].offset, info[FIX].size);
+        // the resource tree is indexed from the loaded image
+        _resources= info[RES];
     }
 
     unsigned sectioncount() const
@@ -329,9 +867,9 @@ enum {
         return _relocs[i];
     }
 
-    size_t minvirtaddr() const
+    uint64_t minvirtaddr() const
     {
-        size_t a= 0;
+        uint64_t a= 0;
         for (unsigned i=0 ; i<sectioncount() ; i++)
         {
             if (i==0 || _sections[i].virtualaddress<a)
@@ -339,37 +877,75 @@ enum {
         }
         return a;
     }
-    size_t maxvirtaddr() const
+    uint64_t maxvirtaddr() const
     {
-        size_t a= 0;
+        uint64_t a= 0;
         for (unsigned i=0 ; i<sectioncount() ; i++)
         {
-            uint32_t sectionend = _sections[i].virtualaddress+std::max(_sections[i].virtualsize, _sections[i].filesize);
+            uint64_t sectionend = _sections[i].virtualaddress+std::max(_sections[i].virtualsize, _sections[i].filesize);
             if (i==0 || sectionend>a)
                 a= sectionend;
         }
         return a;
     }
     uint16_t cpu() const { return _cpu; }
-    uint32_t entryva() const { return _vbase+_entryrva; }
+    uint64_t entryva() const { return _vbase+_entryrva; }
+    bool is64() const { return _is64; }
+    uint64_t vbase() const { return _vbase; }
+    const pe_info& resourcedir() const { return _resources; }
+
+    // drops the import, export and relocation lists, which are only needed
+    // while loading. returns the number of bytes released.
+    size_t releasemetadata()
+    {
+        size_t bytes= _imports.capacity()*sizeof(importsymbol)
+                    + _exports.capacity()*sizeof(exportsymbol)
+                    + _relocs.capacity()*sizeof(relocinfo);
+        for (unsigned i=0 ; i<_imports.size() ; i++)
+            bytes += stringbytes(_imports[i].dllname)+stringbytes(_imports[i].name);
+        for (unsigned i=0 ; i<_exports.size() ; i++)
+            bytes += stringbytes(_exports[i].name);
+        std::vector<importsymbol>().swap(_imports);
+        std::vector<exportsymbol>().swap(_exports);
+        std::vector<relocinfo>().swap(_relocs);
+        return bytes;
+    }
+    // the owner closes the file after loading, nothing is read from it after this
+    void releasesource() { _f= NULL; }
 private:
+    imagesource& file()
+    {
+        if (_f==NULL)
+            throw loadererror("image file already released");
+        return *_f;
+    }
+    // heap memory of a string, short strings are stored inline
+    static size_t stringbytes(const std::string& str)
+    {
+        const char *p= str.data();
+        if (p>=(const char*)&str && p<(const char*)(&str+1))
+            return 0;
+        return str.capacity()+1;
+    }
     std::vector<sectioninfo> _sections;
     std::vector<importsymbol> _imports;
     std::vector<exportsymbol> _exports;
     std::vector<relocinfo> _relocs;
 
-    posixfile& _f;
-    uint32_t _vbase;
+    imagesource *_f;
+    uint64_t _vbase;
     uint16_t _cpu;
     uint32_t _entryrva;
+    bool _is64;
+    pe_info _resources;
 
     off_t rva2fileofs(uint32_t rva)
     {
-        rva += _vbase;
+        uint64_t va= _vbase+rva;
         for (unsigned i=0 ; i<sectioncount() ; i++)
         {
-            if (_sections[i].virtualaddress<=rva && rva<_sections[i].virtualaddress+_sections[i].virtualsize)
-                return rva-_sections[i].virtualaddress+_sections[i].fileoffset;
+            if (_sections[i].virtualaddress<=va && va<_sections[i].virtualaddress+_sections[i].virtualsize)
+                return va-_sections[i].virtualaddress+_sections[i].fileoffset;
         }
         fprintf(stderr,"ERROR:invalid offset 0x%x requested\n", rva);
         throw loadererror("invalid offset");
@@ -395,12 +971,12 @@ private:
     template<typename T>
     void read_until_zero(uint32_t rva, std::vector<T>&v)
     {
-        _f.seek(rva2fileofs(rva));
+        file().seek(rva2fileofs(rva));
         int n=0;
         const unsigned chunksize= 256;
         do {
             v.resize(v.size()+chunksize);
-            int sizeread= _f.readmax(&v.back()-chunksize+1, sizeof(T)*chunksize);
+            int sizeread= file().readmax(&v.back()-chunksize+1, sizeof(T)*chunksize);
             n= sizeread/sizeof(T);
             v.resize(v.size()-chunksize+n);
             for (typename std::vector<T>::iterator i=v.end()-n ; i<v.end() ; i++) {
@@ -420,31 +996,31 @@ private:
     }
     void read_export_table(uint32_t rva, uint32_t size)
     {
-        _f.seek(rva2fileofs(rva));
+        file().seek(rva2fileofs(rva));
         export_header exphdr;
-        _f.readexact(&exphdr, sizeof(exphdr));
+        file().readexact(&exphdr, sizeof(exphdr));
 
         // read export address table
         // entries: if in EXP area : forwarder string
         //          else : exported address
         std::vector<uint32_t> eatlist(exphdr.eatcnt);
         if (exphdr.eatcnt) {
-            _f.seek(rva2fileofs(exphdr.rva_eat));
-            _f.readexact(&eatlist[0], sizeof(uint32_t)*eatlist.size());
+            file().seek(rva2fileofs(exphdr.rva_eat));
+            file().readexact(&eatlist[0], sizeof(uint32_t)*eatlist.size());
         }
 
         // read export name ptr table
         std::vector<uint32_t> entlist(exphdr.namecnt);
         if (exphdr.namecnt) {
-            _f.seek(rva2fileofs(exphdr.rva_name));
-            _f.readexact(&entlist[0], sizeof(uint32_t)*entlist.size());
+            file().seek(rva2fileofs(exphdr.rva_name));
+            file().readexact(&entlist[0], sizeof(uint32_t)*entlist.size());
         }
 
         // read export ordinal table
         std::vector<uint16_t> eotlist(exphdr.namecnt);
         if (exphdr.namecnt) {
-            _f.seek(rva2fileofs(exphdr.rva_ordinal));
-            _f.readexact(&eotlist[0], sizeof(uint16_t)*eotlist.size());
+            file().seek(rva2fileofs(exphdr.rva_ordinal));
+            file().readexact(&eotlist[0], sizeof(uint16_t)*eotlist.size());
         }
         //fprintf(stderr,"read eot from %08lx: %d entries\n", exphdr.rva_ordinal, eotlist.size());
 
@@ -487,37 +1063,47 @@ struct import_header {
         // read import directory
         for (int nimp=0 ; true ; nimp++) {
             import_header imphdr;
-            _f.seek(rva2fileofs(rva)+sizeof(imphdr)*nimp);
-            _f.readexact(&imphdr, sizeof(imphdr));
+            file().seek(rva2fileofs(rva)+sizeof(imphdr)*nimp);
+            file().readexact(&imphdr, sizeof(imphdr));
             if (isnull(imphdr))
                 break;
-            std::vector<uint32_t> ilt;
-            // packed executables often have rva_lookup==0
-            read_until_zero(imphdr.rva_lookup ? imphdr.rva_lookup : imphdr.rva_address, ilt);
-
-            std::string impdllname;
-            impdllname= readstring(imphdr.rva_dllname);
+            if (_is64)
+                read_import_thunks<uint64_t>(imphdr);
+            else
+                read_import_thunks<uint32_t>(imphdr);
+        }
+    }
+    // the ILT/IAT entries are pointer sized: 32 bit for PE32, 64 bit for PE32+
+    template<typename T>
+    void read_import_thunks(const import_header& imphdr)
+    {
+        std::vector<T> ilt;
+        // packed executables often have rva_lookup==0
+        read_until_zero(imphdr.rva_lookup ? imphdr.rva_lookup : imphdr.rva_address, ilt);
 
-            for (unsigned i=0 ; i<ilt.size() ; i++)
-            {
-                importsymbol sym;
-                sym.dllname= impdllname;
-                sym.virtualaddress= _vbase+imphdr.rva_address+4*i;
-                if (ilt[i]&0x80000000) {
-                    sym.ordinal= ilt[i]&0x7fffffff;
-                }
-                else {
-                    // todo: handle 'hint'
-                    sym.name= readstring(ilt[i]+2);
-                }
+        std::string impdllname;
+        impdllname= readstring(imphdr.rva_dllname);
 
-                _imports.push_back(sym);
+        const T ordinalflag= T(1)<<(8*sizeof(T)-1);
+        for (unsigned i=0 ; i<ilt.size() ; i++)
+        {
+            importsymbol sym;
+            sym.dllname= impdllname;
+            sym.virtualaddress= _vbase+imphdr.rva_address+sizeof(T)*i;
+            if (ilt[i]&ordinalflag) {
+                sym.ordinal= ilt[i]&~ordinalflag;
+            }
+            else {
+                // todo: handle 'hint'
+                sym.name= readstring(uint32_t(ilt[i])+2);
             }
+
+            _imports.push_back(sym);
         }
     }
     void read_reloc_table(uint32_t rva, uint32_t size)
     {
-        _f.seek(rva2fileofs(rva));
+        file().seek(rva2fileofs(rva));
         uint32_t roff= rva;
         while (roff<rva+size)
         {
@@ -526,11 +1112,11 @@ struct import_header {
                 uint32_t size;
             };
             relochdr hdr;
-            _f.readexact(&hdr, sizeof(hdr));
+            file().readexact(&hdr, sizeof(hdr));
 
             std::vector<uint16_t> relocs((hdr.size-sizeof(hdr))/sizeof(uint16_t));
             if (relocs.size())
-                _f.readexact(&relocs[0], hdr.size-sizeof(hdr));
+                file().readexact(&relocs[0], hdr.size-sizeof(hdr));
             
             for (unsigned i=0 ; i<relocs.size() ; i++)
             {
@@ -543,271 +1129,2504 @@ struct import_header {
         }
     }
 };
-typedef std::map<std::string,void*> name2ptrmap;
-typedef std::map<uint32_t,void*> ord2ptrmap;
-typedef std::vector<uint8_t> ByteVector;
 
+// call profiling
+//
+// when enabled, GetProcAddress returns a small generated stub instead of the export.
+// the stub loads its procprofile, and jumps to dllprof_enterthunk, which saves the
+// argument registers, and calls dllprof_enter. this records the start time,
+// and replaces the return address with dllprof_exitthunk, the real return address
+// is kept on a per thread call stack. when the export returns into dllprof_exitthunk,
+// dllprof_leave records the duration, and returns the real return address.
+//
+// exceptions or longjmps through a profiled export are not supported.
 
-typedef bool (*DLLENTRYPOINT)(HANDLE HMODULE, DWORD reason, void* reserved);
+#if defined(__GNUC__) && !defined(_WIN32) && (defined(__i386__) || defined(__x86_64__))
+#define HAVE_PROFILE_TRAMPOLINES
+#endif
 
-class DllModule {
-private:
-    posixfile _f;
-    PEFileInfo _pe;
-    uint32_t _baseaddr;
-    uint32_t _base_va;
-public:
-    DllModule(const std::string& dllname, bool bRelocate)
-        : _f(dllname), _pe(_f), _baseaddr(0)
+#ifdef HAVE_PROFILE_TRAMPOLINES
+struct procprofile {
+    procprofile(void *proc, const char *procname, unsigned ord)
+        : target(proc), name(procname?procname:""), ordinal(ord), calls(0), cycles(0)
     {
-        _baseaddr= _pe.minvirtaddr();
-        _base_va= _pe.minvirtaddr();
-        load_sections();
-        if (bRelocate) {
-            relocate(reinterpret_cast<uint32_t>(&_data[0]));
-            import();
-        }
+        for (unsigned i=0 ; i<MYPROFILE_BUCKETS ; i++)
+            histogram[i]= 0;
     }
-    ~DllModule()
+    void *target;
+    std::string name;
+    unsigned ordinal;
+    std::atomic<uint64_t> calls;
+    std::atomic<uint64_t> cycles;
+    std::atomic<uint64_t> histogram[MYPROFILE_BUCKETS];
+
+    void record(uint64_t n)
     {
+        cycles += n;
+        unsigned bucket= n ? 63-__builtin_clzll(n) : 0;
+        histogram[std::min(bucket, unsigned(MYPROFILE_BUCKETS-1))]++;
     }
-    void load_sections()
-    {
-        _data.resize(_pe.maxvirtaddr()-_pe.minvirtaddr());
-        logmsg("dll:va range: %08lx - %08lx\n", _pe.minvirtaddr(), _pe.maxvirtaddr());
-        // load sections
-        for (unsigned i=0 ; i<_pe.sectioncount() ; i++)
-        {
-            logmsg("dll:loading %d: file:%08x:%08lx  va:%08lx, ofs:%08lx\n",
-                    i, uint32_t(_pe.sectionitem(i).fileoffset), _pe.sectionitem(i).filesize,
-                    _pe.sectionitem(i).virtualaddress, _pe.sectionitem(i).virtualaddress-_base_va);
-            if (_pe.sectionitem(i).filesize) {
-                _f.seek(_pe.sectionitem(i).fileoffset);
-                _f.readexact(&_data[_pe.sectionitem(i).virtualaddress-_base_va], _pe.sectionitem(i).filesize);
-            }
-        }
+};
 
-        // process exports 
-        for (unsigned i=0 ; i<_pe.exportcount() ; i++)
-        {
-            if (_pe.exportitem(i).name.empty())
-                _exportsbyordinal[_pe.exportitem(i).ordinal]= &_data[_pe.exportitem(i).virtualaddress-_base_va];
-            else
-                _exportsbyname[_pe.exportitem(i).name]= &_data[_pe.exportitem(i).virtualaddress-_base_va];
-            logmsg("dll:exp %d %08x ord %4d %s\n", i, _pe.exportitem(i).virtualaddress, _pe.exportitem(i).ordinal, _pe.exportitem(i).name.c_str());
-        }
+// these are called from the asm thunks, the names are fixed with asm labels,
+// so the thunks don't need to know about symbol prefixes.
+// on x86_64 the hooks use ms_abi, so they preserve all registers the
+// windows x64 convention expects to be preserved.
+extern "C" void *WINAPIV dllprof_enter(procprofile *proc, void **retslot) __asm__("dllprof_enter") ALIGN_STACK;
+extern "C" void *WINAPIV dllprof_leave() __asm__("dllprof_leave") ALIGN_STACK;
+extern "C" void dllprof_enterthunk() __asm__("dllprof_enterthunk");
+extern "C" void dllprof_exitthunk() __asm__("dllprof_exitthunk");
 
-        // process imports
-        for (unsigned i=0 ; i<_pe.importcount() ; i++)
-        {
-            logmsg("dll:import %d: %08x: ord %4d %s %s\n", i, _pe.importitem(i).virtualaddress, _pe.importitem(i).ordinal, _pe.importitem(i).dllname.c_str(), _pe.importitem(i).name.c_str());
-        }
-        // relocate
-        logmsg("dll:%d relocs\n", _pe.reloccount());
-        for (unsigned i=0 ; i<_pe.reloccount() ; i++)
-        {
-           // fprintf(stderr,"reloc %d: %08lx %d\n", i, _pe.relocitem(i).virtualaddress, _pe.relocitem(i).type);
-        }
-#ifdef __MACH__ 
-#if MAC_OS_X_VERSION_MAX_ALLOWED >= MAC_OS_X_VERSION_10_7
+#ifdef __x86_64__
+// enter: r10= procprofile, [rsp]= return address
+// exit:  rax, xmm0 hold the return value
+__asm__(
+    ".text\n"
+    ".globl dllprof_enterthunk\n"
+"dllprof_enterthunk:\n"
+    "pushq %rcx\n"
+    "pushq %rdx\n"
+    "pushq %r8\n"
+    "pushq %r9\n"
+    "subq $0x68, %rsp\n"            // shadow space + xmm0-3, keeps rsp 16 byte aligned
+    "movdqu %xmm0, 0x20(%rsp)\n"
+    "movdqu %xmm1, 0x30(%rsp)\n"
+    "movdqu %xmm2, 0x40(%rsp)\n"
+    "movdqu %xmm3, 0x50(%rsp)\n"
+    "movq %r10, %rcx\n"
+    "leaq 0x88(%rsp), %rdx\n"       // address of the return address
+    "call dllprof_enter\n"
+    "movq %rax, %r11\n"
+    "movdqu 0x20(%rsp), %xmm0\n"
+    "movdqu 0x30(%rsp), %xmm1\n"
+    "movdqu 0x40(%rsp), %xmm2\n"
+    "movdqu 0x50(%rsp), %xmm3\n"
+    "addq $0x68, %rsp\n"
+    "popq %r9\n"
+    "popq %r8\n"
+    "popq %rdx\n"
+    "popq %rcx\n"
+    "jmp *%r11\n"
 
-#define PAGE_MASK 0xFFF
-        // make executable
-        uint32_t dataaddr= (uint32_t)&_data[0];
-        uint32_t pageofs0= dataaddr&PAGE_MASK;
-        uint32_t pageofs1= (dataaddr+_data.size()+pageofs0)&PAGE_MASK;
-        if (pageofs1)
-            pageofs1= 0x1000-pageofs1;
-        int rc= mprotect(&_data[0]-pageofs0, _data.size()+pageofs0+pageofs1, PROT_EXEC|PROT_READ|PROT_WRITE);
-        if (rc) {
-            printf("mprotect(%d)  %p:%08x -> %p:%08x\n", errno,
-                    &_data[0], (int)_data.size(),
-                    &_data[0]-pageofs0, (int)(_data.size()+pageofs0+pageofs1));
-        }
-#endif
-#endif
-    }
+    ".globl dllprof_exitthunk\n"
+"dllprof_exitthunk:\n"
+    "subq $8, %rsp\n"               // room for the real return address
+    "pushq %rax\n"
+    "subq $0x30, %rsp\n"            // shadow space + xmm0
+    "movdqu %xmm0, 0x20(%rsp)\n"
+    "call dllprof_leave\n"
+    "movq %rax, 0x38(%rsp)\n"
+    "movdqu 0x20(%rsp), %xmm0\n"
+    "addq $0x30, %rsp\n"
+    "popq %rax\n"
+    "ret\n"
+);
+#else
+// enter: eax= procprofile, [esp]= return address
+// exit:  eax:edx, st0 hold the return value
+__asm__(
+    ".text\n"
+    ".globl dllprof_enterthunk\n"
+"dllprof_enterthunk:\n"
+    "pushl %ecx\n"                  // used by fastcall and thiscall
+    "pushl %edx\n"
+    "leal 8(%esp), %ecx\n"          // address of the return address
+    "pushl %ecx\n"
+    "pushl %eax\n"
+    "call dllprof_enter\n"
+    "addl $8, %esp\n"
+    "popl %edx\n"
+    "popl %ecx\n"
+    "jmp *%eax\n"
 
-    // fixup types
-#define IMAGE_REL_BASED_ABSOLUTE        0
-#define IMAGE_REL_BASED_HIGH            1
-#define IMAGE_REL_BASED_LOW             2
-#define IMAGE_REL_BASED_HIGHLOW         3
-#define IMAGE_REL_BASED_HIGHADJ         4
-#define IMAGE_REL_BASED_MIPS_JMPADDR    5
-#define IMAGE_REL_BASED_SECTION         6
-#define IMAGE_REL_BASED_REL32           7
-#define IMAGE_REL_BASED_MIPS_JMPADDR16  9
-#define IMAGE_REL_BASED_IA64_IMM64      9
-#define IMAGE_REL_BASED_DIR64          10
-#define IMAGE_REL_BASED_HIGH3ADJ       11
+    ".globl dllprof_exitthunk\n"
+"dllprof_exitthunk:\n"
+    "subl $4, %esp\n"               // room for the real return address
+    "pushl %eax\n"
+    "pushl %edx\n"
+    "call dllprof_leave\n"
+    "movl %eax, 8(%esp)\n"
+    "popl %edx\n"
+    "popl %eax\n"
+    "ret\n"
+);
+#endif
 
-    void relocate(uint32_t target)
-    {
-        uint32_t delta= target-_baseaddr;
+struct callframe {
+    procprofile *proc;
+    void *retaddr;
+    uint64_t start;
+};
+#define MAX_PROFILE_DEPTH 256
+static thread_local callframe t_callstack[MAX_PROFILE_DEPTH];
+static thread_local unsigned t_calldepth;
 
-        logmsg("dll:%08x: <", delta);
-        // relocate
-        for (unsigned i=0 ; i<_pe.reloccount() ; i++)
-        {
-            //fprintf(stderr,"relocating %08lx: %08x\n", _pe.relocitem(i).virtualaddress, *(uint32_t*)&_data[_pe.relocitem(i).virtualaddress-_base_va]);
-            uint8_t *p= &_data[_pe.relocitem(i).virtualaddress-_base_va];
-            switch(_pe.relocitem(i).type)
-            {
-                case IMAGE_REL_BASED_ABSOLUTE:   logmsg("A"); break;
-                case IMAGE_REL_BASED_HIGH:       *(uint16_t*)p += delta>>16;    logmsg("H"); break;
-                case IMAGE_REL_BASED_LOW:        *(uint16_t*)p += delta&0xFFFF; logmsg("L"); break;
-                case IMAGE_REL_BASED_HIGHLOW:    *(uint32_t*)p += delta;        logmsg("-"); break;
-                case IMAGE_REL_BASED_HIGHADJ:      throw unimplemented(); // ?? ... have to re-read description
-                default:
-                   fprintf(stderr,"ERROR: unhandled fixup type %d\n", _pe.relocitem(i).type);
-                   throw unimplemented();
-            }
-        }
-        _baseaddr= target;
-        logmsg(">\n");
+void *WINAPIV dllprof_enter(procprofile *proc, void **retslot)
+{
+    proc->calls++;
+    // too deeply nested calls are only counted, not timed
+    if (t_calldepth<MAX_PROFILE_DEPTH) {
+        callframe& frame= t_callstack[t_calldepth++];
+        frame.proc= proc;
+        frame.retaddr= *retslot;
+        *retslot= (void*)dllprof_exitthunk;
+        frame.start= __builtin_ia32_rdtsc();
+    }
+    return proc->target;
+}
+void *WINAPIV dllprof_leave()
+{
+    uint64_t now= __builtin_ia32_rdtsc();
+    callframe& frame= t_callstack[--t_calldepth];
+    frame.proc->record(now-frame.start);
+    return frame.retaddr;
+}
 
+// owns the stubs and statistics of one module
+class ProcProfiler {
+public:
+    ProcProfiler() : _stubsused(STUBSPERPAGE) { }
+    ~ProcProfiler()
+    {
+        for (unsigned i=0 ; i<_pages.size() ; i++)
+            munmap(_pages[i], PAGESIZE);
+        for (procmap::iterator i=_procs.begin() ; i!=_procs.end() ; ++i)
+            delete (*i).second.first;
     }
+    // returns the stub for 'proc', creating it on first use
+    void *trampoline(void *proc, const char *name, unsigned ordinal)
+    {
+        std::lock_guard<std::mutex> lock(_mtx);
+        procmap::iterator i= _procs.find(proc);
+        if (i!=_procs.end())
+            return (*i).second.second;
 
-#ifndef _WIN32
-#define ALIGN_STACK  __attribute__((force_align_arg_pointer))
+        if (_stubsused==STUBSPERPAGE) {
+            void *page= mmap(NULL, PAGESIZE, PROT_READ|PROT_WRITE|PROT_EXEC, MAP_PRIVATE|MAP_ANON, -1, 0);
+            if (page==MAP_FAILED)
+                return proc;
+            _pages.push_back(page);
+            _stubsused= 0;
+        }
+        uint8_t *stub= (uint8_t*)_pages.back()+STUBSIZE*_stubsused++;
+        procprofile *prof= new procprofile(proc, name, ordinal);
+#ifdef __x86_64__
+        stub[0]= 0x49; stub[1]= 0xba;       // movabs r10, prof
+        *(uint64_t*)(stub+2)= (uintptr_t)prof;
+        stub[10]= 0x49; stub[11]= 0xbb;     // movabs r11, dllprof_enterthunk
+        *(uint64_t*)(stub+12)= (uintptr_t)dllprof_enterthunk;
+        stub[20]= 0x41; stub[21]= 0xff; stub[22]= 0xe3; // jmp r11
 #else
-#define ALIGN_STACK
+        stub[0]= 0xb8;                      // mov eax, prof
+        *(uint32_t*)(stub+1)= (uintptr_t)prof;
+        stub[5]= 0xe9;                      // jmp dllprof_enterthunk
+        *(uint32_t*)(stub+6)= (uintptr_t)dllprof_enterthunk-(uintptr_t)(stub+10);
 #endif
+        _procs[proc]= std::make_pair(prof, (void*)stub);
+        return stub;
+    }
+    unsigned getstats(MyProcProfile *stats, unsigned maxcount)
+    {
+        std::lock_guard<std::mutex> lock(_mtx);
+        unsigned n= 0;
+        for (procmap::iterator i=_procs.begin() ; i!=_procs.end() && n<maxcount ; ++i, ++n)
+        {
+            procprofile *prof= (*i).second.first;
+            stats[n].name= prof->name.empty() ? NULL : prof->name.c_str();
+            stats[n].ordinal= prof->ordinal;
+            stats[n].proc= (FARPROC)prof->target;
+            stats[n].calls= prof->calls;
+            stats[n].cycles= prof->cycles;
+            for (unsigned b=0 ; b<MYPROFILE_BUCKETS ; b++)
+                stats[n].histogram[b]= prof->histogram[b];
+        }
+        return n;
+    }
+    unsigned count()
+    {
+        std::lock_guard<std::mutex> lock(_mtx);
+        return _procs.size();
+    }
+private:
+    enum { PAGESIZE=0x1000, STUBSIZE=32, STUBSPERPAGE=PAGESIZE/STUBSIZE };
+    // export -> ( statistics, stub )
+    typedef std::map<void*,std::pair<procprofile*,void*> > procmap;
+
+    std::mutex _mtx;
+    procmap _procs;
+    std::vector<void*> _pages;
+    unsigned _stubsused;
+};
+#endif
+bool g_profiling;
+
+// returns the implementation of imported functions provided outside DllModule, or NULL
+void *findimport(const std::string& name);
+
+// resource ids are either numbers, or case insensitive names
+struct resourceid {
+    resourceid() : id(0) { }
+    uint32_t id;
+    std::string name;   // uppercase, empty for numeric ids
+
+    bool operator<(const resourceid& r) const
+    {
+        if (name.empty()!=r.name.empty())
+            return name.empty();
+        return name.empty() ? id<r.id : name<r.name;
+    }
+    bool operator==(const resourceid& r) const { return id==r.id && name==r.name; }
+};
+struct resourceentry {
+    resourceid type;
+    resourceid name;
+    uint16_t lang;
+    size_t offset;      // in the image
+    uint32_t size;
+
+    bool operator<(const resourceentry& r) const
+    {
+        if (!(type==r.type))
+            return type<r.type;
+        if (!(name==r.name))
+            return name<r.name;
+        return lang<r.lang;
+    }
+};
+
+typedef std::map<std::string,void*> name2ptrmap;
+typedef std::vector<uint8_t> ByteVector;
+
+// page aligned, executable memory holding the loaded image
+#if !defined(_WIN32) && defined(__linux__) && !defined(MAP_FIXED_NOREPLACE)
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+class ImageMemory {
+public:
+    ImageMemory() : _p(NULL), _size(0), _borrowed(false) { }
+    ~ImageMemory() { release(); }
+
+    // tries to place the image at 'preferred' first, address() tells where it ended up
+    void allocate(size_t size, uint64_t preferred= 0)
+    {
+        release();
+#ifndef _WIN32
+        void *p= MAP_FAILED;
+        size_t pagemask= sysconf(_SC_PAGESIZE)-1;
+        if (preferred && (preferred&pagemask)==0 && preferred==uintptr_t(preferred)) {
+#ifdef MAP_FIXED_NOREPLACE
+            // kernels before 4.17 ignore the flag, and treat the address as a hint
+            p= mmap((void*)uintptr_t(preferred), std::max(size, size_t(1)), PROT_READ|PROT_WRITE|PROT_EXEC, MAP_PRIVATE|MAP_ANON|MAP_FIXED_NOREPLACE, -1, 0);
+#else
+            p= mmap((void*)uintptr_t(preferred), std::max(size, size_t(1)), PROT_READ|PROT_WRITE|PROT_EXEC, MAP_PRIVATE|MAP_ANON, -1, 0);
+#endif
+        }
+        if (p==MAP_FAILED)
+            p= mmap(NULL, std::max(size, size_t(1)), PROT_READ|PROT_WRITE|PROT_EXEC, MAP_PRIVATE|MAP_ANON, -1, 0);
+        if (p==MAP_FAILED)
+            throw posixerror("mmap", "image");
+        _p= (uint8_t*)p;
+#else
+        _p= (uint8_t*)calloc(std::max(size, size_t(1)), 1);
+        if (_p==NULL)
+            throw loadererror("out of memory");
+#endif
+        _size= size;
+    }
+    // uses memory supplied by the caller, it is not zeroed, and not released.
+    // the pages stay as they are: file data is copied into them, not mapped.
+    void adopt(uint8_t *p, size_t size)
+    {
+        release();
+        _p= p;
+        _size= size;
+        _borrowed= true;
+    }
+    bool borrowed() const { return _borrowed; }
+    uint64_t address() const { return reinterpret_cast<uintptr_t>(_p); }
+#ifndef _WIN32
+    // maps an image file private copy-on-write at exactly 'base'.
+    // returns false when that range is taken, or the file cannot be mapped executable.
+    bool mapimage(int fd, off_t fileofs, size_t size, uint64_t base)
+    {
+        release();
+        if (base!=uintptr_t(base))
+            return false;
+#ifdef MAP_FIXED_NOREPLACE
+        void *p= mmap((void*)uintptr_t(base), std::max(size, size_t(1)), PROT_READ|PROT_WRITE|PROT_EXEC, MAP_PRIVATE|MAP_FIXED_NOREPLACE, fd, fileofs);
+#else
+        void *p= mmap((void*)uintptr_t(base), std::max(size, size_t(1)), PROT_READ|PROT_WRITE|PROT_EXEC, MAP_PRIVATE, fd, fileofs);
+#endif
+        if (p==MAP_FAILED)
+            return false;
+        if (p!=(void*)uintptr_t(base)) {
+            munmap(p, std::max(size, size_t(1)));
+            return false;
+        }
+        _p= (uint8_t*)p;
+        _size= size;
+        return true;
+    }
+    // replaces the whole image by a private mapping of 'fd', which holds a copy of it
+    bool remapimage(int fd, off_t fileofs)
+    {
+        return MAP_FAILED!=mmap(_p, std::max(_size, size_t(1)), PROT_READ|PROT_WRITE|PROT_EXEC, MAP_PRIVATE|MAP_FIXED, fd, fileofs);
+    }
+    // releases the whole pages within [ofs, ofs+len), they read back as zeros or
+    // as the original file contents. returns the number of bytes that were resident.
+    size_t discard(size_t ofs, size_t len)
+    {
+        size_t pagesize= sysconf(_SC_PAGESIZE);
+        size_t first= (ofs+pagesize-1)&~(pagesize-1);
+        size_t last= std::min(ofs+len, _size)&~(pagesize-1);
+        if (first>=last || _borrowed)
+            return 0;
+        size_t resident= 0;
+#ifdef __linux__
+        std::vector<unsigned char> vec((last-first)/pagesize);
+#else
+        std::vector<char> vec((last-first)/pagesize);
+#endif
+        if (mincore(_p+first, last-first, &vec[0])==0) {
+            for (unsigned i=0 ; i<vec.size() ; i++)
+                if (vec[i]&1)
+                    resident += pagesize;
+        }
+        if (madvise(_p+first, last-first, MADV_DONTNEED))
+            return 0;
+        return resident;
+    }
+    // restricts the whole pages within [ofs, ofs+len), the mapping extends the
+    // image to a whole page
+    void protect(size_t ofs, size_t len, int prot)
+    {
+        size_t pagemask= sysconf(_SC_PAGESIZE)-1;
+        size_t first= (ofs+pagemask)&~pagemask;
+        size_t last= std::min(ofs+len, (_size+pagemask)&~pagemask)&~pagemask;
+        if (first<last)
+            mprotect(_p+first, last-first, prot);
+    }
+#endif
+    // replace whole pages at 'ofs' by a private, copy on write mapping of the file.
+    // returns false when that is not possible, the caller then reads the data.
+    bool mapfile(size_t ofs, int fd, off_t fileofs, size_t len)
+    {
+#ifndef _WIN32
+        size_t pagemask= sysconf(_SC_PAGESIZE)-1;
+        if (fd<0 || len==0 || _borrowed || ((ofs|fileofs|len)&pagemask) || ofs+len>_size)
+            return false;
+        if (MAP_FAILED!=mmap(_p+ofs, len, PROT_READ|PROT_WRITE|PROT_EXEC, MAP_PRIVATE|MAP_FIXED, fd, fileofs))
+            return true;
+        // a failed MAP_FIXED may have dropped the old pages
+        if (MAP_FAILED==mmap(_p+ofs, len, PROT_READ|PROT_WRITE|PROT_EXEC, MAP_PRIVATE|MAP_ANON|MAP_FIXED, -1, 0))
+            throw posixerror("mmap", "image");
+#endif
+        return false;
+    }
+#ifndef _WIN32
+    // replaces whole pages at 'ofs' by a shared mapping of 'fd', at the same offset
+    void mapshared(size_t ofs, int fd, size_t len)
+    {
+        if (MAP_FAILED==mmap(_p+ofs, len, PROT_READ|PROT_WRITE|PROT_EXEC, MAP_SHARED|MAP_FIXED, fd, ofs))
+            throw posixerror("mmap", "shared pages");
+    }
+    // asks for the pages to be placed on numa 'node', call before touching them.
+    // fails silently when there is no such node.
+    void prefernode(unsigned node)
+    {
+#if defined(__linux__) && defined(SYS_mbind)
+        const int MPOL_PREFERRED= 1;
+        unsigned long mask[1024/(8*sizeof(unsigned long))];
+        if (node>=8*sizeof(mask))
+            return;
+        memset(mask, 0, sizeof(mask));
+        mask[node/(8*sizeof(unsigned long))]= 1UL<<(node%(8*sizeof(unsigned long)));
+        syscall(SYS_mbind, _p, _size, MPOL_PREFERRED, mask, 8*sizeof(mask), 0);
+#endif
+    }
+#endif
+    uint8_t& operator[](size_t i) { return _p[i]; }
+    const uint8_t& operator[](size_t i) const { return _p[i]; }
+    size_t size() const { return _size; }
+private:
+    ImageMemory(const ImageMemory&);
+    ImageMemory& operator=(const ImageMemory&);
+
+    void release()
+    {
+        if (_p==NULL)
+            return;
+        if (!_borrowed) {
+#ifndef _WIN32
+            munmap(_p, std::max(_size, size_t(1)));
+#else
+            free(_p);
+#endif
+        }
+        _p= NULL;
+        _size= 0;
+        _borrowed= false;
+    }
+    uint8_t *_p;
+    size_t _size;
+    bool _borrowed;
+};
+
+#ifndef _WIN32
+bool pwriteall(int fd, const uint8_t *p, size_t n, off_t ofs)
+{
+    while (n) {
+        ssize_t r= pwrite(fd, p, n, ofs);
+        if (r<=0) {
+            if (r==-1 && errno==EINTR)
+                continue;
+            return false;
+        }
+        p += r; n -= r; ofs += r;
+    }
+    return true;
+}
+
+// modification time in nanoseconds, a rebuild within the same second changes it
+int64_t mtimens(const struct stat& st)
+{
+#ifdef __APPLE__
+    return int64_t(st.st_mtimespec.tv_sec)*1000000000+st.st_mtimespec.tv_nsec;
+#else
+    return int64_t(st.st_mtim.tv_sec)*1000000000+st.st_mtim.tv_nsec;
+#endif
+}
+
+// a relocated image in shared memory ( /dev/shm ), built by the first process
+// which loads the dll, and mapped copy-on-write at the same address by the others.
+// only pages a process writes to, like the import table and data, become private.
+class SharedImage {
+public:
+    SharedImage(const std::string& shmname, const struct stat& dllstat)
+        : _name(shmname), _dev(dllstat.st_dev), _ino(dllstat.st_ino), _filesize(dllstat.st_size), _mtime(mtimens(dllstat))
+    {
+    }
+    const std::string& name() const { return _name; }
+
+    // maps an existing image of this dll, returns false when there is none yet,
+    // or when it cannot be used here, the caller then loads it privately.
+    bool attach(ImageMemory& data, size_t size)
+    {
+        int fd= shm_open(_name.c_str(), O_RDONLY, 0);
+        if (fd==-1)
+            return false;
+        // the name is predictable, only run code from an image this user wrote,
+        // and nobody else can change
+        struct stat st;
+        if (fstat(fd, &st) || st.st_uid!=geteuid() || (st.st_mode&(S_IWGRP|S_IWOTH))) {
+            logmsg("dll:not using shared image %s, it is not owned by this user\n", _name.c_str());
+            close(fd);
+            return false;
+        }
+        header hdr;
+        bool ok= pread(fd, &hdr, sizeof(hdr), 0)==sizeof(hdr) && memcmp(hdr.magic, MAGIC, sizeof(hdr.magic))==0;
+        if (ok && (!matches(hdr) || (!hdr.complete && abandoned(hdr, st)))) {
+            // built from another version of the dll, or its creator died while
+            // building it: make room for a new image
+            logmsg("dll:removing stale shared image %s\n", _name.c_str());
+            shm_unlink(_name.c_str());
+            ok= false;
+        }
+        // an incomplete image is still being built
+        ok= ok && hdr.complete && hdr.size==size
+            && data.mapimage(fd, pagesize(), size, hdr.base);
+        close(fd);
+        return ok;
+    }
+    // copies the relocated, but not yet imported image to shared memory, and
+    // replaces 'data' by a mapping of it.
+    // returns false when 'data' stays private, like when another process is
+    // creating the image at the same time.
+    bool publish(ImageMemory& data)
+    {
+        int fd= shm_open(_name.c_str(), O_RDWR|O_CREAT|O_EXCL, 0600);
+        if (fd==-1)
+            return false;
+        header hdr;
+        memcpy(hdr.magic, MAGIC, sizeof(hdr.magic));
+        hdr.base= data.address();
+        hdr.size= data.size();
+        hdr.dev= _dev;
+        hdr.ino= _ino;
+        hdr.filesize= _filesize;
+        hdr.mtime= _mtime;
+        hdr.pid= getpid();
+        hdr.complete= 0;
+
+        bool ok= ftruncate(fd, pagesize()+data.size())==0
+            && pwrite(fd, &hdr, sizeof(hdr), 0)==sizeof(hdr)
+            && pwriteall(fd, &data[0], data.size(), pagesize());
+        if (ok) {
+            // the complete flag goes last, readers ignore the image until then
+            hdr.complete= 1;
+            ok= pwrite(fd, &hdr, sizeof(hdr), 0)==sizeof(hdr) && data.remapimage(fd, pagesize());
+        }
+        if (!ok)
+            shm_unlink(_name.c_str());
+        close(fd);
+        return ok;
+    }
+private:
+    static constexpr const char *MAGIC= "DLLSHIM2";
+    // an incomplete image not written to for this long is abandoned
+    enum { BUILDTIMEOUT= 60 };
+    struct header {
+        char magic[8];
+        uint64_t base;
+        uint64_t size;
+        // identifies the dll file
+        uint64_t dev;
+        uint64_t ino;
+        uint64_t filesize;
+        int64_t mtime;      // in nanoseconds
+        int32_t pid;        // the creator
+        uint32_t complete;
+    };
+    bool matches(const header& hdr) const
+    {
+        return hdr.dev==_dev && hdr.ino==_ino && hdr.filesize==_filesize && hdr.mtime==_mtime;
+    }
+    // the creator of an incomplete image is gone, or has been busy too long
+    static bool abandoned(const header& hdr, const struct stat& st)
+    {
+        if (kill(hdr.pid, 0)==-1 && errno==ESRCH)
+            return true;
+        return time(NULL)-st.st_mtime>BUILDTIMEOUT;
+    }
+    static size_t pagesize() { return sysconf(_SC_PAGESIZE); }
+
+    std::string _name;
+    uint64_t _dev;
+    uint64_t _ino;
+    uint64_t _filesize;
+    int64_t _mtime;
+};
+
+// the numa nodes, and which cpus they have.
+// read from /sys/devices/system/node, or set by MySetNumaTopology for testing.
+class NumaTopology {
+public:
+    NumaTopology() : _nodes(0), _loaded(false) { }
+
+    // 'nodes' has the cpu list of each node, separated by ';', like "0-3;4-7"
+    bool configure(const char *nodes)
+    {
+        std::lock_guard<std::mutex> lock(_mtx);
+        _cpunode.clear();
+        _nodes= 0;
+        _loaded= true;
+        if (nodes==NULL) {
+            readsysfs();
+            return true;
+        }
+        std::string spec= nodes;
+        size_t start= 0;
+        while (true) {
+            size_t end= spec.find(';', start);
+            if (!addnode(_nodes, spec.substr(start, end==std::string::npos ? end : end-start))) {
+                _cpunode.clear();
+                _nodes= 0;
+                return false;
+            }
+            _nodes++;
+            if (end==std::string::npos)
+                break;
+            start= end+1;
+        }
+        return true;
+    }
+    unsigned nodecount()
+    {
+        std::lock_guard<std::mutex> lock(_mtx);
+        load();
+        return _nodes;
+    }
+    // the node of the calling thread, MySetThreadNumaNode overrides the cpu's node
+    unsigned currentnode()
+    {
+        if (_threadnode>=0)
+            return _threadnode;
+#ifdef __linux__
+        int cpu= sched_getcpu();
+        std::lock_guard<std::mutex> lock(_mtx);
+        load();
+        if (cpu>=0 && unsigned(cpu)<_cpunode.size() && _cpunode[cpu]>=0)
+            return _cpunode[cpu];
+#endif
+        return 0;
+    }
+    static void setthreadnode(int node) { _threadnode= node; }
+private:
+    // caller holds _mtx
+    void load()
+    {
+        if (!_loaded)
+            readsysfs();
+        _loaded= true;
+    }
+    void readsysfs()
+    {
+#ifdef __linux__
+        for (unsigned node=0 ; ; node++) {
+            char path[64];
+            snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+            FILE *f= fopen(path, "r");
+            if (f==NULL)
+                break;
+            char line[4096];
+            bool ok= fgets(line, sizeof(line), f)!=NULL;
+            fclose(f);
+            std::string list= ok ? line : "";
+            list= list.substr(0, list.find_last_not_of(" \r\n")+1);
+            // memory only nodes have no cpus
+            if (!list.empty() && !addnode(node, list))
+                break;
+            _nodes= node+1;
+        }
+#endif
+        if (_nodes==0)
+            _nodes= 1;
+    }
+    // parses a cpu list like "0-3,8,10-11"
+    bool addnode(unsigned node, const std::string& list)
+    {
+        const char *p= list.c_str();
+        while (*p) {
+            char *end;
+            unsigned long first= strtoul(p, &end, 10);
+            unsigned long last= first;
+            if (end==p)
+                return false;
+            if (*end=='-') {
+                p= end+1;
+                last= strtoul(p, &end, 10);
+                if (end==p || last<first)
+                    return false;
+            }
+            if (last>=4096)
+                return false;
+            if (_cpunode.size()<=last)
+                _cpunode.resize(last+1, -1);
+            for (unsigned long cpu=first ; cpu<=last ; cpu++)
+                _cpunode[cpu]= node;
+            p= end;
+            if (*p==',')
+                p++;
+            else if (*p)
+                return false;
+        }
+        return true;
+    }
+
+    std::mutex _mtx;
+    std::vector<int> _cpunode;
+    unsigned _nodes;
+    bool _loaded;
+    static thread_local int _threadnode;
+};
+thread_local int NumaTopology::_threadnode= -1;
+NumaTopology g_numa;
+bool g_numareplicas;
+#else
+class SharedImage;
+#endif
+
+typedef bool (__stdcall *DLLENTRYPOINT)(HANDLE HMODULE, DWORD reason, void* reserved);
+
+class DllModule {
+private:
+    std::string _name;
+    std::unique_ptr<imagesource> _f;
+    PEFileInfo _pe;
+    uint64_t _baseaddr;
+    uint64_t _base_va;
+    bool _relocated;
+    unsigned _fixups;
+    bool _shared;
+    size_t _discarded;
+    size_t _metadatafreed;
+public:
+    // address range of an export, or of the start of a section without exports
+    struct symbolrange {
+        uintptr_t start;
+        size_t size;
+        std::string name;
+
+        bool operator<(const symbolrange& r) const { return start<r.start; }
+    };
+
+    // takes ownership of 'src'.
+    // with 'shared', the relocated image is taken from, or put in shared memory.
+    // with 'dest', the image is placed in that memory of the caller, instead of
+    // in memory of its own.
+    DllModule(imagesource *src, const std::string& dllname, bool bRelocate, SharedImage *shared= NULL, uint8_t *dest= NULL, size_t destsize= 0)
+        : _name(dllname.substr(dllname.find_last_of("/\\")+1)), _f(src), _pe(*_f), _baseaddr(0), _relocated(false), _fixups(0), _shared(false), _discarded(0), _metadatafreed(0), _ordinalbase(0), _rsrc(NULL), _rsrcsize(0)
+    {
+        if (_pe.is64()!=(sizeof(void*)==8))
+            throw loadererror(_pe.is64() ? "PE32+ image needs a 64-bit loader" : "PE32 image needs a 32-bit loader");
+        _baseaddr= _pe.minvirtaddr();
+        _base_va= _pe.minvirtaddr();
+#ifndef _WIN32
+        if (bRelocate && shared && shared->attach(_data, _pe.maxvirtaddr()-_pe.minvirtaddr())) {
+            // already relocated by the process which built the shared image
+            logmsg("dll:%s mapped from shared image %s\n", _name.c_str(), shared->name().c_str());
+            _baseaddr= _data.address();
+            _relocated= _baseaddr!=_base_va;
+            _shared= true;
+        }
+        else
+#endif
+        {
+            size_t imagesize= _pe.maxvirtaddr()-_pe.minvirtaddr();
+            if (dest) {
+                if (imagesize>destsize)
+                    throw insufficientmemory(imagesize);
+                _data.adopt(dest, imagesize);
+                clear_uninitialized();
+            }
+            else {
+                _data.allocate(imagesize, _pe.minvirtaddr());
+            }
+            // when the image landed at its preferred base, the fixups are all no-ops
+            bool needsfixups= bRelocate && _data.address()!=_baseaddr;
+#ifndef _WIN32
+            if (needsfixups && _f->fd()!=-1 && inaddressorder())
+                load_relocating(_data.address());
+            else
+#endif
+            {
+                load_sections();
+                if (needsfixups)
+                    relocate(_data.address());
+            }
+            if (needsfixups) {
+                _relocated= true;
+                _fixups= _pe.reloccount();
+            }
+            else if (bRelocate) {
+                logmsg("dll:%s loaded at its preferred base %08lx\n", _name.c_str(), _baseaddr);
+            }
+#ifndef _WIN32
+            if (bRelocate && shared) {
+                _shared= shared->publish(_data);
+            }
+#endif
+        }
+        index_exports();
+        index_resources();
+        if (bRelocate)
+            import();
+#ifndef _WIN32
+        if (bRelocate && g_numareplicas && !_data.borrowed())
+            replicate();
+        // keep code read-only, so its pages stay shared
+        if (_shared)
+            protect_code();
+#endif
+        if (bRelocate)
+            release_loaderdata();
+    }
+    ~DllModule()
+    {
+    }
+    void load_sections()
+    {
+        logmsg("dll:va range: %08lx - %08lx\n", _pe.minvirtaddr(), _pe.maxvirtaddr());
+        // load sections
+        for (unsigned i=0 ; i<_pe.sectioncount() ; i++)
+        {
+            logmsg("dll:loading %d: file:%08x:%08lx  va:%08lx, ofs:%08lx\n",
+                    i, uint32_t(_pe.sectionitem(i).fileoffset), _pe.sectionitem(i).filesize,
+                    _pe.sectionitem(i).virtualaddress, _pe.sectionitem(i).virtualaddress-_base_va);
+            if (_pe.sectionitem(i).filesize) {
+                size_t ofs= _pe.sectionitem(i).virtualaddress-_base_va;
+                size_t filesize= _pe.sectionitem(i).filesize;
+                // whole pages are mapped from the file when aligned, the remainder is read
+                size_t mapped= filesize & ~size_t(0xFFF);
+                if (!_data.mapfile(ofs, _f->fd(), _pe.sectionitem(i).fileoffset, mapped))
+                    mapped= 0;
+                if (filesize>mapped) {
+                    _f->seek(_pe.sectionitem(i).fileoffset+mapped);
+                    _f->readexact(&_data[ofs+mapped], filesize-mapped);
+                }
+            }
+        }
+    }
+    // memory from the caller is not zeroed, clear what the sections do not fill
+    void clear_uninitialized()
+    {
+        std::vector<std::pair<size_t,size_t> > filled;
+        for (unsigned i=0 ; i<_pe.sectioncount() ; i++)
+        {
+            size_t ofs= _pe.sectionitem(i).virtualaddress-_base_va;
+            if (_pe.sectionitem(i).filesize && ofs<_data.size())
+                filled.push_back(std::make_pair(ofs, std::min(ofs+_pe.sectionitem(i).filesize, _data.size())));
+        }
+        std::sort(filled.begin(), filled.end());
+        size_t pos= 0;
+        for (unsigned i=0 ; i<filled.size() ; i++)
+        {
+            if (filled[i].first>pos)
+                memset(&_data[pos], 0, filled[i].first-pos);
+            pos= std::max(pos, filled[i].second);
+        }
+        if (pos<_data.size())
+            memset(&_data[pos], 0, _data.size()-pos);
+    }
+#ifndef _WIN32
+    // like load_sections followed by relocate, but all reads are issued at once, and
+    // the fixups in each chunk are applied as soon as it has arrived, so relocating
+    // overlaps with waiting for the disk.
+    void load_relocating(uint64_t target)
+    {
+        const size_t CHUNKSIZE= 0x10000;
+        logmsg("dll:va range: %08lx - %08lx\n", _pe.minvirtaddr(), _pe.maxvirtaddr());
+        std::vector<AsyncReads::range> chunks;
+        for (unsigned i=0 ; i<_pe.sectioncount() ; i++)
+        {
+            if (_pe.sectionitem(i).filesize==0)
+                continue;
+            size_t ofs= _pe.sectionitem(i).virtualaddress-_base_va;
+            size_t filesize= _pe.sectionitem(i).filesize;
+            size_t mapped= filesize & ~size_t(0xFFF);
+            if (_data.mapfile(ofs, _f->fd(), _pe.sectionitem(i).fileoffset, mapped)) {
+                // start reading the mapped pages, fixups in them fault them in
+                madvise(&_data[ofs], mapped, MADV_WILLNEED);
+            }
+            else {
+                mapped= 0;
+            }
+            for (size_t pos=mapped ; pos<filesize ; pos+=CHUNKSIZE)
+                chunks.push_back(AsyncReads::range(_pe.sectionitem(i).fileoffset+pos, &_data[ofs+pos], std::min(CHUNKSIZE, filesize-pos)));
+        }
+        AsyncReads reads(_f->fd(), chunks);
+
+        // the fixups and the sections are both in address order, so one pass finds the
+        // fixups of each chunk. those outside the chunks are applied while the reads
+        // are in progress, those spanning a chunk boundary at the end.
+        std::vector<std::pair<unsigned,unsigned> > fixups(chunks.size());
+        std::vector<unsigned> spanning;
+        uint64_t delta= target-_baseaddr;
+        unsigned r= 0;
+        for (unsigned c=0 ; c<chunks.size() ; c++)
+        {
+            size_t start= chunks[c].p-&_data[0];
+            size_t end= start+chunks[c].len;
+            for ( ; r<_pe.reloccount() && fixupofs(r)<start ; r++) {
+                if (fixupofs(r)+fixupsize(_pe.relocitem(r).type)>start)
+                    spanning.push_back(r);
+                else
+                    applyfixup(&_data[fixupofs(r)], _pe.relocitem(r).type, delta);
+            }
+            fixups[c].first= r;
+            while (r<_pe.reloccount() && fixupofs(r)+fixupsize(_pe.relocitem(r).type)<=end)
+                r++;
+            fixups[c].second= r;
+            for ( ; r<_pe.reloccount() && fixupofs(r)<end ; r++)
+                spanning.push_back(r);
+        }
+        for ( ; r<_pe.reloccount() ; r++)
+            applyfixup(&_data[fixupofs(r)], _pe.relocitem(r).type, delta);
+
+        int c;
+        while ((c= reads.next())!=-1)
+            for (unsigned i=fixups[c].first ; i<fixups[c].second ; i++)
+                applyfixup(&_data[fixupofs(i)], _pe.relocitem(i).type, delta);
+        for (unsigned i=0 ; i<spanning.size() ; i++)
+            applyfixup(&_data[fixupofs(spanning[i])], _pe.relocitem(spanning[i]).type, delta);
+        _baseaddr= target;
+    }
+    size_t fixupofs(unsigned i) const
+    {
+        return _pe.relocitem(i).virtualaddress-_base_va;
+    }
+    // load_relocating needs the sections and the fixups in ascending order,
+    // which is how linkers emit them
+    bool inaddressorder() const
+    {
+        for (unsigned i=1 ; i<_pe.sectioncount() ; i++)
+            if (_pe.sectionitem(i).virtualaddress<_pe.sectionitem(i-1).virtualaddress)
+                return false;
+        for (unsigned i=1 ; i<_pe.reloccount() ; i++)
+            if (_pe.relocitem(i).virtualaddress<_pe.relocitem(i-1).virtualaddress)
+                return false;
+        return true;
+    }
+#endif
+    void index_exports()
+    {
+        // the export items are in ordinal order
+        _ordinalbase= _pe.exportcount() ? _pe.exportitem(0).ordinal : 0;
+        _exportprocs.resize(_pe.exportcount());
+        _exportnames.resize(_pe.exportcount());
+        for (unsigned i=0 ; i<_pe.exportcount() ; i++)
+        {
+            if (_pe.exportitem(i).virtualaddress)
+                _exportprocs[i]= (FARPROC)TranslateAddress(&_data[_pe.exportitem(i).virtualaddress-_base_va]);
+
+            if (!_pe.exportitem(i).name.empty()) {
+                _exportsbyname[_pe.exportitem(i).name]= (void*)_exportprocs[i];
+                // the map keys outlive the parsed export list
+                _exportnames[i]= _exportsbyname.find(_pe.exportitem(i).name)->first.c_str();
+            }
+            logmsg("dll:exp %d %08x ord %4d %s\n", i, _pe.exportitem(i).virtualaddress, _pe.exportitem(i).ordinal, _pe.exportitem(i).name.c_str());
+        }
+
+        for (unsigned i=0 ; i<_pe.importcount() ; i++)
+        {
+            logmsg("dll:import %d: %08x: ord %4d %s %s\n", i, _pe.importitem(i).virtualaddress, _pe.importitem(i).ordinal, _pe.importitem(i).dllname.c_str(), _pe.importitem(i).name.c_str());
+        }
+        // relocate
+        logmsg("dll:%d relocs\n", _pe.reloccount());
+        for (unsigned i=0 ; i<_pe.reloccount() ; i++)
+        {
+           // fprintf(stderr,"reloc %d: %08lx %d\n", i, _pe.relocitem(i).virtualaddress, _pe.relocitem(i).type);
+        }
+    }
+
+    // after relocation and binding, the discardable sections ( like .reloc ),
+    // the parsed import, export and relocation lists, and the file are no longer needed.
+    void release_loaderdata()
+    {
+#ifndef _WIN32
+        for (unsigned i=0 ; i<_pe.sectioncount() ; i++)
+        {
+            if (!(_pe.sectionitem(i).flags&IMAGE_SCN_MEM_DISCARDABLE))
+                continue;
+            size_t ofs= _pe.sectionitem(i).virtualaddress-_base_va;
+            size_t len= std::max(_pe.sectionitem(i).virtualsize, _pe.sectionitem(i).filesize);
+            // resources stay, even when a linker marked them discardable
+            if (_rsrc && size_t(_rsrc-&_data[0])<ofs+len && ofs<size_t(_rsrc-&_data[0])+_rsrcsize)
+                continue;
+            _discarded += _data.discard(ofs, len);
+        }
+#endif
+        _metadatafreed += _pe.releasemetadata();
+        _pe.releasesource();
+        _f.reset();
+        logmsg("dll:%s released %d bytes of sections, %d bytes of metadata\n", _name.c_str(), _discarded, _metadatafreed);
+    }
+#ifndef _WIN32
+    void protect_code()
+    {
+        for (unsigned i=0 ; i<_pe.sectioncount() ; i++)
+        {
+            uint32_t flags= _pe.sectionitem(i).flags;
+            if ((flags&IMAGE_SCN_MEM_EXECUTE) && !(flags&IMAGE_SCN_MEM_WRITE))
+                _data.protect(_pe.sectionitem(i).virtualaddress-_base_va,
+                        std::max(_pe.sectionitem(i).virtualsize, _pe.sectionitem(i).filesize), PROT_READ|PROT_EXEC);
+        }
+    }
+
+    // keeps a copy of the code and read-only data on each numa node, relocated for
+    // its own address. the writable pages are moved to a shared memory file, which is
+    // mapped at the same offset in each copy, so all copies use the same data, also
+    // through the rip-relative references of x64 code, which have no fixups.
+    // the image stays as it is when there is one node, or when a page holds both
+    // code and data.
+    // the shared pages are the same for all copies, so their absolute pointers, like
+    // vtables, function pointer tables, or pointers to read-only data, keep pointing
+    // into the original image: calls and reads through them are correct, but not
+    // local to the node.
+    void replicate()
+    {
+        enum { PG_NONE, PG_SKIP, PG_COPY, PG_SHARED };
+        unsigned nodes= g_numa.nodecount();
+        if (nodes<2)
+            return;
+        size_t pagesize= sysconf(_SC_PAGESIZE);
+        std::vector<uint8_t> kind((_data.size()+pagesize-1)/pagesize, PG_NONE);
+        std::vector<bool> exec(kind.size());
+        for (unsigned i=0 ; i<_pe.sectioncount() ; i++)
+        {
+            uint32_t flags= _pe.sectionitem(i).flags;
+            size_t ofs= _pe.sectionitem(i).virtualaddress-_base_va;
+            size_t len= std::max(_pe.sectionitem(i).virtualsize, _pe.sectionitem(i).filesize);
+            // discardable sections, like .reloc, are not needed by the copies
+            uint8_t k= (flags&IMAGE_SCN_MEM_WRITE) ? PG_SHARED : (flags&IMAGE_SCN_MEM_DISCARDABLE) ? PG_SKIP : PG_COPY;
+            for (size_t pg= ofs/pagesize ; pg<(ofs+len+pagesize-1)/pagesize && pg<kind.size() ; pg++)
+            {
+                if (kind[pg]!=PG_NONE && (kind[pg]==PG_SHARED)!=(k==PG_SHARED)) {
+                    logmsg("dll:%s not replicated, page %d has code and data\n", _name.c_str(), pg);
+                    return;
+                }
+                kind[pg]= std::max(kind[pg], k);
+                if (flags&IMAGE_SCN_MEM_EXECUTE)
+                    exec[pg]= true;
+            }
+        }
+
+        int fd= sharedpages();
+        try {
+            // move the writable pages to the file
+            for (size_t pg=0 ; pg<kind.size() ; )
+            {
+                size_t end= pg;
+                while (end<kind.size() && kind[end]==PG_SHARED)
+                    end++;
+                if (end>pg) {
+                    size_t len= std::min(end*pagesize, _data.size())-pg*pagesize;
+                    if (!pwriteall(fd, &_data[pg*pagesize], len, pg*pagesize))
+                        throw posixerror("pwrite", _name);
+                    _data.mapshared(pg*pagesize, fd, len);
+                }
+                pg= end+1;
+            }
+            for (unsigned node=0 ; node<nodes ; node++)
+            {
+                std::unique_ptr<ImageMemory> copy(new ImageMemory);
+                copy->allocate(_data.size());
+                copy->prefernode(node);
+                for (size_t pg=0 ; pg<kind.size() ; pg++)
+                {
+                    size_t len= std::min((pg+1)*pagesize, _data.size())-pg*pagesize;
+                    if (kind[pg]==PG_COPY)
+                        memcpy(&(*copy)[pg*pagesize], &_data[pg*pagesize], len);
+                    else if (kind[pg]==PG_SHARED)
+                        copy->mapshared(pg*pagesize, fd, len);
+                }
+                uint64_t delta= copy->address()-_data.address();
+                for (unsigned i=0 ; i<_pe.reloccount() ; i++)
+                {
+                    size_t ofs= _pe.relocitem(i).virtualaddress-_base_va;
+                    // the pointers in the shared pages stay as they are, see above
+                    if (kind[ofs/pagesize]==PG_COPY)
+                        applyfixup(&(*copy)[ofs], _pe.relocitem(i).type, delta);
+                }
+                // the copies are read-only, only the shared pages stay writable
+                for (size_t pg=0 ; pg<kind.size() ; )
+                {
+                    size_t end= pg+1;
+                    while (end<kind.size() && (kind[end]==PG_SHARED)==(kind[pg]==PG_SHARED) && exec[end]==exec[pg])
+                        end++;
+                    if (kind[pg]!=PG_SHARED)
+                        copy->protect(pg*pagesize, (end-pg)*pagesize, exec[pg] ? PROT_READ|PROT_EXEC : PROT_READ);
+                    pg= end;
+                }
+                _replicas.push_back(std::move(copy));
+            }
+        }
+        catch(...)
+        {
+            close(fd);
+            throw;
+        }
+        close(fd);
+        logmsg("dll:%s replicated on %d nodes\n", _name.c_str(), nodes);
+    }
+    // an unnamed shared memory file, large enough for the image
+    int sharedpages()
+    {
+#ifdef MFD_CLOEXEC
+        int fd= memfd_create(_name.c_str(), MFD_CLOEXEC);
+#else
+        char shmname[64];
+        snprintf(shmname, sizeof(shmname), "/dllloader-%d-%p", (int)getpid(), this);
+        int fd= shm_open(shmname, O_RDWR|O_CREAT|O_EXCL, 0600);
+        if (fd!=-1)
+            shm_unlink(shmname);
+#endif
+        if (fd==-1)
+            throw posixerror("memfd", _name);
+        if (ftruncate(fd, _data.size())) {
+            close(fd);
+            throw posixerror("ftruncate", _name);
+        }
+        return fd;
+    }
+#endif
+
+    // flattens the type/name/language tree in .rsrc into a sorted index,
+    // so lookups are a binary search, the data stays in the image.
+    void index_resources()
+    {
+        if (_pe.resourcedir().size==0)
+            return;
+        uint64_t va= _pe.vbase()+_pe.resourcedir().offset;
+        if (va<_base_va || va-_base_va+_pe.resourcedir().size>_data.size())
+            throw loadererror("invalid resource directory");
+        _rsrc= &_data[va-_base_va];
+        _rsrcsize= _pe.resourcedir().size;
+
+        resourceentry ent;
+        index_resourcedir(0, 0, ent);
+        std::sort(_resources.begin(), _resources.end());
+    }
+    struct rsrc_directory {
+        uint32_t flags;
+        uint32_t timestamp;
+        uint16_t vermajor;
+        uint16_t verminor;
+        uint16_t namecount;
+        uint16_t idcount;
+        // followed by namecount+idcount rsrc_direntry's
+    };
+    struct rsrc_direntry {
+        uint32_t name;      // id, or 0x80000000|offset of a counted utf16 string
+        uint32_t offset;    // 0x80000000|offset of a subdirectory, or offset of an rsrc_dataentry
+    };
+    struct rsrc_dataentry {
+        uint32_t rva;
+        uint32_t size;
+        uint32_t codepage;
+        uint32_t reserved;
+    };
+    void index_resourcedir(uint32_t diroffset, int level, resourceentry& ent)
+    {
+        // level 0: type, 1: name, 2: language
+        if (level>2 || diroffset+sizeof(rsrc_directory)>_rsrcsize)
+            return;
+        const rsrc_directory *dir= (const rsrc_directory*)(_rsrc+diroffset);
+        unsigned n= dir->namecount+dir->idcount;
+        if (diroffset+sizeof(rsrc_directory)+n*sizeof(rsrc_direntry)>_rsrcsize)
+            return;
+        const rsrc_direntry *entries= (const rsrc_direntry*)(dir+1);
+        for (unsigned i=0 ; i<n ; i++)
+        {
+            resourceid id;
+            if (entries[i].name&0x80000000)
+                id.name= rsrcstring(entries[i].name&0x7fffffff);
+            else
+                id.id= entries[i].name;
+
+            if (level==0)
+                ent.type= id;
+            else if (level==1)
+                ent.name= id;
+            else
+                ent.lang= id.id;
+
+            if (entries[i].offset&0x80000000) {
+                index_resourcedir(entries[i].offset&0x7fffffff, level+1, ent);
+                continue;
+            }
+            // data entries normally only appear at the language level
+            if (level<2)
+                ent.lang= 0;
+            if (entries[i].offset+sizeof(rsrc_dataentry)>_rsrcsize)
+                continue;
+            const rsrc_dataentry *data= (const rsrc_dataentry*)(_rsrc+entries[i].offset);
+            uint64_t datava= _pe.vbase()+data->rva;
+            if (datava<_base_va || datava-_base_va+data->size>_data.size())
+                continue;
+            ent.offset= datava-_base_va;
+            ent.size= data->size;
+            _resources.push_back(ent);
+        }
+    }
+    std::string rsrcstring(uint32_t offset) const
+    {
+        std::string str;
+        if (offset+2>_rsrcsize)
+            return str;
+        const uint16_t *p= (const uint16_t*)(_rsrc+offset);
+        unsigned len= std::min(unsigned(p[0]), unsigned((_rsrcsize-offset-2)/2));
+        for (unsigned i=0 ; i<len ; i++)
+            str += resourcechar(p[1+i]);
+        return str;
+    }
+public:
+    // windows compares resource names case insensitive, non ascii is kept as utf8
+    static std::string resourcechar(uint16_t c)
+    {
+        std::string s;
+        if (c<0x80)
+            s += char(toupper(c));
+        else if (c<0x800) {
+            s += char(0xc0|(c>>6));
+            s += char(0x80|(c&0x3f));
+        }
+        else {
+            s += char(0xe0|(c>>12));
+            s += char(0x80|((c>>6)&0x3f));
+            s += char(0x80|(c&0x3f));
+        }
+        return s;
+    }
+    // lang<0 takes the first language
+    const resourceentry *findresource(const resourceid& type, const resourceid& name, int lang) const
+    {
+        resourceentry key;
+        key.type= type;
+        key.name= name;
+        key.lang= lang<0 ? 0 : lang;
+        std::vector<resourceentry>::const_iterator i= std::lower_bound(_resources.begin(), _resources.end(), key);
+        if (i==_resources.end() || !((*i).type==type) || !((*i).name==name)) {
+            if (lang<=0)
+                return NULL;
+            // no exact language match, take the first one of this type/name
+            key.lang= 0;
+            i= std::lower_bound(_resources.begin(), _resources.end(), key);
+            if (i==_resources.end() || !((*i).type==type) || !((*i).name==name))
+                return NULL;
+        }
+        else if (lang>0 && (*i).lang!=lang) {
+            // fall back to the neutral language, then to the first one
+            key.lang= 0;
+            i= std::lower_bound(_resources.begin(), _resources.end(), key);
+        }
+        return &*i;
+    }
+    bool ownsresource(const resourceentry *res) const
+    {
+        return !_resources.empty() && res>=&_resources.front() && res<=&_resources.back();
+    }
+    void *resourcedata(const resourceentry *res) const
+    {
+        return TranslateAddress(&_data[res->offset]);
+    }
+
+    // fixup types
+#define IMAGE_REL_BASED_ABSOLUTE        0
+#define IMAGE_REL_BASED_HIGH            1
+#define IMAGE_REL_BASED_LOW             2
+#define IMAGE_REL_BASED_HIGHLOW         3
+#define IMAGE_REL_BASED_HIGHADJ         4
+#define IMAGE_REL_BASED_MIPS_JMPADDR    5
+#define IMAGE_REL_BASED_SECTION         6
+#define IMAGE_REL_BASED_REL32           7
+#define IMAGE_REL_BASED_MIPS_JMPADDR16  9
+#define IMAGE_REL_BASED_IA64_IMM64      9
+#define IMAGE_REL_BASED_DIR64          10
+#define IMAGE_REL_BASED_HIGH3ADJ       11
+
+    void relocate(uint64_t target)
+    {
+        uint64_t delta= target-_baseaddr;
+
+        logmsg("dll:%08x: <", delta);
+        // relocate
+        for (unsigned i=0 ; i<_pe.reloccount() ; i++)
+        {
+            //fprintf(stderr,"relocating %08lx: %08x\n", _pe.relocitem(i).virtualaddress, *(uint32_t*)&_data[_pe.relocitem(i).virtualaddress-_base_va]);
+            applyfixup(&_data[_pe.relocitem(i).virtualaddress-_base_va], _pe.relocitem(i).type, delta);
+        }
+        _baseaddr= target;
+        logmsg(">\n");
+
+    }
+    // the number of bytes a fixup changes
+    static unsigned fixupsize(unsigned type)
+    {
+        switch(type)
+        {
+            case IMAGE_REL_BASED_HIGH:
+            case IMAGE_REL_BASED_LOW:       return 2;
+            case IMAGE_REL_BASED_DIR64:     return 8;
+            default:                        return 4;
+        }
+    }
+    static void applyfixup(uint8_t *p, unsigned type, uint64_t delta)
+    {
+        switch(type)
+        {
+            case IMAGE_REL_BASED_ABSOLUTE:   logmsg("A"); break;
+            case IMAGE_REL_BASED_HIGH:       *(uint16_t*)p += delta>>16;    logmsg("H"); break;
+            case IMAGE_REL_BASED_LOW:        *(uint16_t*)p += delta&0xFFFF; logmsg("L"); break;
+            case IMAGE_REL_BASED_HIGHLOW:    *(uint32_t*)p += uint32_t(delta); logmsg("-"); break;
+            case IMAGE_REL_BASED_DIR64:      *(uint64_t*)p += delta;        logmsg("Q"); break;
+            case IMAGE_REL_BASED_HIGHADJ:      throw unimplemented(); // ?? ... have to re-read description
+            default:
+               fprintf(stderr,"ERROR: unhandled fixup type %d\n", type);
+               throw unimplemented();
+        }
+    }
+
+#ifndef _WIN32_WCE
+    // these are called from dll code, so must use the windows calling conventions
+    static void __cdecl undefined() ALIGN_STACK { fprintf(stderr,"unimported\n"); }
+    static void *__stdcall LocalAlloc(int flag, int size) ALIGN_STACK { return malloc(size); }
+    static void *__stdcall LocalFree(void *p) ALIGN_STACK { free(p); return NULL; }
+    static void __stdcall SetLastError(uint32_t e) ALIGN_STACK { }
+    static bool __stdcall DisableThreadLibraryCalls(void *hmod) ALIGN_STACK { return true; }
+    static void __cdecl dummy() ALIGN_STACK { }
+
+    static void *__cdecl alignedmalloc(size_t size) ALIGN_STACK { return malloc(size); }
+    static void __cdecl alignedfree(void *p) ALIGN_STACK { free(p); }
+#endif
+    void import()
+    {
+        for (unsigned i=0 ; i<_pe.importcount() ; i++)
+        {
+// DisableThreadLibraryCalls
+// SetLastError
+// __CppXcptFilter
+// __dllonexit
+// _adjust_fdiv
+// _assert
+// _except_handler3
+// _initterm
+// _onexit
+
+            // the IAT slots are pointer sized, the image bitness matches ours
+            uintptr_t *p= (uintptr_t*)&_data[_pe.importitem(i).virtualaddress-_base_va];
+#ifndef _WIN32_WCE
+            // todo: add importer object, which knows where to find external functions
+            void *fn;
+            if ((fn= findimport(_pe.importitem(i).name))!=NULL) *p=(uintptr_t)fn;
+            else if (_pe.importitem(i).name=="LocalAlloc") *p=(uintptr_t)LocalAlloc;
+            else if (_pe.importitem(i).name=="LocalFree") *p=(uintptr_t)LocalFree;
+            else if (_pe.importitem(i).name=="DisableThreadLibraryCalls") *p=(uintptr_t)DisableThreadLibraryCalls;
+            else if (_pe.importitem(i).name=="SetLastError") *p=(uintptr_t)SetLastError;
+            else if (_pe.importitem(i).name=="malloc") *p=(uintptr_t)alignedmalloc;
+            else if (_pe.importitem(i).name=="free") *p=(uintptr_t)alignedfree;
+            else if (_pe.importitem(i).name=="_adjust_fdiv") *p=(uintptr_t)undefined;
+            else *p=(uintptr_t)dummy;
+#else
+            // ... replace some imports with kernel variants
+#endif
+            logmsg("dll:import %d: %08x:=%08x   ord %4d %s %s\n", i, _pe.importitem(i).virtualaddress, *p, _pe.importitem(i).ordinal, _pe.importitem(i).dllname.c_str(), _pe.importitem(i).name.c_str());
+        }
+    }
+    void *getprocbyname(const char *procname) const
+    {
+        name2ptrmap::const_iterator i= _exportsbyname.find(procname);
+        if (i==_exportsbyname.end() || (*i).second==NULL) {
+            MySetLastError(ERROR_PROC_NOT_FOUND);
+            return NULL;
+        }
+        return (*i).second;
+    }
+    void *getprocbyordinal(unsigned ord) const
+    {
+        if (ord<_ordinalbase || ord-_ordinalbase>=_exportprocs.size() || _exportprocs[ord-_ordinalbase]==NULL) {
+            MySetLastError(ERROR_PROC_NOT_FOUND);
+            return NULL;
+        }
+        return (void*)_exportprocs[ord-_ordinalbase];
+    }
+    // fills in the proc of each request, returns the number found.
+    // the named requests are sorted once, and matched against the sorted
+    // export names in a single merge pass, when there are enough of them.
+    unsigned resolve(MyProcRequest *requests, unsigned count) const
+    {
+        unsigned found= 0;
+        std::vector<MyProcRequest*> named;
+        for (unsigned i=0 ; i<count ; i++)
+        {
+            requests[i].proc= NULL;
+            if (requests[i].name)
+                named.push_back(&requests[i]);
+            else if (requests[i].ordinal>=_ordinalbase && requests[i].ordinal-_ordinalbase<_exportprocs.size())
+                requests[i].proc= _exportprocs[requests[i].ordinal-_ordinalbase];
+            if (requests[i].proc)
+                found++;
+        }
+        if (named.empty())
+            return found;
+
+        if (named.size()*16<_exportsbyname.size()) {
+            // few requests, in a large table
+            for (unsigned i=0 ; i<named.size() ; i++) {
+                name2ptrmap::const_iterator e= _exportsbyname.find(named[i]->name);
+                if (e!=_exportsbyname.end() && (*e).second) {
+                    named[i]->proc= (FARPROC)(*e).second;
+                    found++;
+                }
+            }
+            return found;
+        }
+        std::sort(named.begin(), named.end(), requestbyname);
+        name2ptrmap::const_iterator e= _exportsbyname.begin();
+        for (unsigned i=0 ; i<named.size() && e!=_exportsbyname.end() ; i++) {
+            int cmp;
+            while (e!=_exportsbyname.end() && (cmp= strcmp((*e).first.c_str(), named[i]->name))<0)
+                ++e;
+            if (e!=_exportsbyname.end() && cmp==0 && (*e).second) {
+                named[i]->proc= (FARPROC)(*e).second;
+                found++;
+            }
+        }
+        return found;
+    }
+    static bool requestbyname(const MyProcRequest *a, const MyProcRequest *b)
+    {
+        return strcmp(a->name, b->name)<0;
+    }
+    void exporttable(MyExportTable *table) const
+    {
+        table->base= _ordinalbase;
+        table->count= _exportprocs.size();
+        table->procs= _exportprocs.empty() ? NULL : &_exportprocs[0];
+        table->names= _exportnames.empty() ? NULL : &_exportnames[0];
+    }
+
+    void *TranslateAddress(const void*p) const
+    {
+        return reinterpret_cast<void*>(
+                reinterpret_cast<uintptr_t>(p)
+                -reinterpret_cast<uintptr_t>(&_data[0])
+                +uintptr_t(_baseaddr)
+                );
+    }
+    size_t size() const { return _data.size(); }
+    const uint8_t* data() const { return &_data[0]; }
+    uintptr_t imagebase() const { return _baseaddr; }
+    size_t imagesize() const { return _data.size(); }
+    uint64_t preferredbase() const { return _base_va; }
+    bool relocated() const { return _relocated; }
+    unsigned fixupcount() const { return _fixups; }
+    bool shared() const { return _shared; }
+    size_t discardedbytes() const { return _discarded; }
+    size_t metadatabytes() const { return _metadatafreed; }
+    // with 'headers' also true for the image base of a copy, which dlls use as their
+    // instance handle ( &__ImageBase ). it is before the first section, where _data starts.
+    bool contains(uintptr_t addr, bool withheaders= true) const
+    {
+        uintptr_t headers= withheaders ? _base_va-_pe.vbase() : 0;
+        if (addr+headers>=_baseaddr && addr+headers-_baseaddr<_data.size()+headers)
+            return true;
+#ifndef _WIN32
+        for (unsigned i=0 ; i<_replicas.size() ; i++)
+            if (addr+headers>=_replicas[i]->address() && addr+headers-_replicas[i]->address()<_data.size()+headers)
+                return true;
+#endif
+        return false;
+    }
+#ifndef _WIN32
+    unsigned replicacount() const { return _replicas.size(); }
+    uintptr_t replicabase(unsigned i) const { return _replicas[i]->address(); }
+    // the address of 'p' in the copy of the calling thread's numa node
+    void *nodelocal(void *p) const
+    {
+        if (_replicas.empty() || uintptr_t(p)<_baseaddr || uintptr_t(p)-_baseaddr>=_data.size())
+            return p;
+        unsigned node= g_numa.currentnode();
+        if (node>=_replicas.size())
+            return p;
+        return (void*)(_replicas[node]->address()+(uintptr_t(p)-_baseaddr));
+    }
+#endif
+    const std::string& name() const { return _name; }
+
+    // sorted by address, named 'dll!export', built on first use
+    const std::vector<symbolrange>& symbols()
+    {
+        if (_symbols.empty())
+            buildsymbols();
+        return _symbols;
+    }
+    const symbolrange *findsymbol(uintptr_t addr)
+    {
+#ifndef _WIN32
+        // the symbols are for the original, the copies have the same layout
+        for (unsigned i=0 ; i<_replicas.size() ; i++)
+            if (addr>=_replicas[i]->address() && addr-_replicas[i]->address()<_data.size())
+                addr= addr-_replicas[i]->address()+_baseaddr;
+#endif
+        const std::vector<symbolrange>& syms= symbols();
+        symbolrange key;
+        key.start= addr;
+        std::vector<symbolrange>::const_iterator i= std::upper_bound(syms.begin(), syms.end(), key);
+        if (i==syms.begin())
+            return NULL;
+        --i;
+        if (addr-(*i).start>=(*i).size)
+            return NULL;
+        return &*i;
+    }
+#ifdef HAVE_PROFILE_TRAMPOLINES
+    ProcProfiler& profiler() { return _profiler; }
+#endif
+
+    DLLENTRYPOINT getentrypoint() const
+    {
+        logmsg("getep: eva=%08lx base=%08lx data=%08lx\n", _pe.entryva(), _base_va, &_data[_pe.entryva()-_base_va]);
+        return reinterpret_cast<DLLENTRYPOINT>(TranslateAddress(&_data[_pe.entryva()-_base_va]));
+    }
+private:
+    // an export extends up to the next export, or the end of its section
+    void buildsymbols()
+    {
+        std::vector<std::pair<uint64_t,std::string> > exps;
+        for (unsigned i=0 ; i<_exportprocs.size() ; i++)
+        {
+            if (_exportprocs[i]==NULL)
+                continue;
+            char ordname[16];
+            snprintf(ordname, sizeof(ordname), "#%u", _ordinalbase+i);
+            exps.push_back(std::make_pair(uintptr_t(_exportprocs[i])-_baseaddr+_base_va,
+                        _exportnames[i] ? std::string(_exportnames[i]) : std::string(ordname)));
+        }
+        std::sort(exps.begin(), exps.end());
+
+        for (unsigned i=0 ; i<_pe.sectioncount() ; i++)
+        {
+            uint64_t secstart= _pe.sectionitem(i).virtualaddress;
+            uint64_t secend= secstart+std::max(_pe.sectionitem(i).virtualsize, _pe.sectionitem(i).filesize);
+            std::vector<std::pair<uint64_t,std::string> >::iterator e= std::lower_bound(exps.begin(), exps.end(), std::make_pair(secstart, std::string()));
+            if (e==exps.end() || (*e).first>secstart)
+                addsymbol(secstart, (e==exps.end() || (*e).first>=secend) ? secend : (*e).first, _pe.sectionitem(i).name);
+            for ( ; e!=exps.end() && (*e).first<secend ; ++e)
+            {
+                std::vector<std::pair<uint64_t,std::string> >::iterator next= e+1;
+                // aliases at the same address get the first name
+                while (next!=exps.end() && (*next).first==(*e).first)
+                    ++next;
+                addsymbol((*e).first, (next==exps.end() || (*next).first>=secend) ? secend : (*next).first, (*e).second);
+                e= next-1;
+            }
+        }
+        std::sort(_symbols.begin(), _symbols.end());
+    }
+    void addsymbol(uint64_t va, uint64_t vaend, const std::string& name)
+    {
+        if (vaend<=va)
+            return;
+        symbolrange sym;
+        sym.start= _baseaddr+(va-_base_va);
+        sym.size= vaend-va;
+        sym.name= _name+"!"+name;
+        _symbols.push_back(sym);
+    }
+
+    name2ptrmap _exportsbyname;
+    unsigned _ordinalbase;
+    std::vector<FARPROC> _exportprocs;
+    std::vector<const char*> _exportnames;
+    ImageMemory _data;
+    std::vector<symbolrange> _symbols;
+    const uint8_t *_rsrc;
+    uint32_t _rsrcsize;
+    std::vector<resourceentry> _resources;
+#ifndef _WIN32
+    std::vector<std::unique_ptr<ImageMemory> > _replicas;
+#endif
+#ifdef HAVE_PROFILE_TRAMPOLINES
+    ProcProfiler _profiler;
+#endif
+};
+
+// all loaded modules, used for mapping addresses back to dlls
+std::mutex g_moduleslock;
+std::vector<DllModule*> g_modules;
+bool g_perfmap;
+
+// caller holds g_moduleslock
+DllModule *findmodule(uintptr_t addr)
+{
+    for (unsigned i=0 ; i<g_modules.size() ; i++)
+        if (g_modules[i]->contains(addr, false))
+            return g_modules[i];
+    // the headers of a module packed in an arena overlap the end of the one before it
+    for (unsigned i=0 ; i<g_modules.size() ; i++)
+        if (g_modules[i]->contains(addr))
+            return g_modules[i];
+    return NULL;
+}
+
+// perf reads symbols for unknown code from /tmp/perf-<pid>.map,
+// lines of: <start> <size> <name>, all hex without 0x.
+// perf report reads the map after the run, so entries are only ever appended:
+// samples taken in a dll before it was freed still need its symbols.
+// caller holds g_moduleslock
+void appendperfmap(DllModule *dll)
+{
+#ifndef _WIN32
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+    FILE *f= fopen(path, "a");
+    if (f==NULL) {
+        fprintf(stderr,"ERROR: %d writing %s\n", errno, path);
+        return;
+    }
+    const std::vector<DllModule::symbolrange>& syms= dll->symbols();
+    // the same symbols again for each numa copy
+    for (unsigned r=0 ; r<=dll->replicacount() ; r++)
+    {
+        uintptr_t delta= r ? dll->replicabase(r-1)-dll->imagebase() : 0;
+        for (unsigned j=0 ; j<syms.size() ; j++)
+            fprintf(f, "%llx %llx %s\n", (unsigned long long)(syms[j].start+delta), (unsigned long long)syms[j].size, syms[j].name.c_str());
+    }
+    fclose(f);
+#endif
+}
+
+void registermodule(DllModule *dll)
+{
+    std::lock_guard<std::mutex> lock(g_moduleslock);
+    g_modules.push_back(dll);
+    if (g_perfmap)
+        appendperfmap(dll);
+}
+void unregistermodule(DllModule *dll)
+{
+    std::lock_guard<std::mutex> lock(g_moduleslock);
+    g_modules.erase(std::remove(g_modules.begin(), g_modules.end(), dll), g_modules.end());
+}
+
+// resource functions, for the application and for the loaded dlls
+
+// a string, MAKEINTRESOURCE(id) or "#id"
+template<typename CHAR>
+bool makeresourceid(const CHAR *str, resourceid& id)
+{
+    if (str==NULL)
+        return false;
+    if (uintptr_t(str)<0x10000) {
+        id.id= uintptr_t(str);
+        return true;
+    }
+    if (str[0]=='#') {
+        id.id= 0;
+        for (const CHAR *p= str+1 ; *p ; p++) {
+            if (*p<'0' || *p>'9')
+                return false;
+            id.id= id.id*10+(*p-'0');
+        }
+        return true;
+    }
+    for (const CHAR *p= str ; *p ; p++)
+        id.name += DllModule::resourcechar(uint16_t(*p));
+    return true;
+}
+
+// dlls pass their own instance handle, which for us is NULL, or an address in their image.
+// 'caller' is the return address of the import shim, identifying the calling dll.
+DllModule *resourcemodule(HMODULE hModule, void *caller)
+{
+    std::lock_guard<std::mutex> lock(g_moduleslock);
+    for (unsigned i=0 ; i<g_modules.size() ; i++)
+        if (reinterpret_cast<HMODULE>(g_modules[i])==hModule)
+            return g_modules[i];
+    DllModule *dll= findmodule(hModule ? uintptr_t(hModule) : uintptr_t(caller));
+    if (dll==NULL)
+        MySetLastError(ERROR_INVALID_HANDLE);
+    return dll;
+}
+template<typename CHAR>
+const resourceentry *findresource(DllModule *dll, const CHAR *type, const CHAR *name, int lang)
+{
+    resourceid typeid_, nameid;
+    if (dll==NULL || !makeresourceid(type, typeid_) || !makeresourceid(name, nameid)) {
+        MySetLastError(ERROR_RESOURCE_NAME_NOT_FOUND);
+        return NULL;
+    }
+    const resourceentry *res= dll->findresource(typeid_, nameid, lang);
+    if (res==NULL)
+        MySetLastError(ERROR_RESOURCE_NAME_NOT_FOUND);
+    return res;
+}
 #ifndef _WIN32_WCE
-    static void undefined() ALIGN_STACK { fprintf(stderr,"unimported\n"); }
-    static void *__stdcall LocalAlloc(int flag, int size) ALIGN_STACK { return malloc(size); }
-    static void *__stdcall LocalFree(void *p) ALIGN_STACK { free(p); return NULL; }
-    static void __stdcall SetLastError(uint32_t e) ALIGN_STACK { }
-    static bool __stdcall DisableThreadLibraryCalls(void *hmod) ALIGN_STACK { return true; }
-    static void dummy() ALIGN_STACK { }
+// the kernel32 resource functions, as imported by dlls
+typedef uint16_t WCHAR16;
+static void *__stdcall ResFindResourceA(HMODULE hModule, const char *name, const char *type) ALIGN_STACK;
+static void *__stdcall ResFindResourceA(HMODULE hModule, const char *name, const char *type)
+{
+    return (void*)findresource(resourcemodule(hModule, __builtin_return_address(0)), type, name, -1);
+}
+static void *__stdcall ResFindResourceW(HMODULE hModule, const WCHAR16 *name, const WCHAR16 *type) ALIGN_STACK;
+static void *__stdcall ResFindResourceW(HMODULE hModule, const WCHAR16 *name, const WCHAR16 *type)
+{
+    return (void*)findresource(resourcemodule(hModule, __builtin_return_address(0)), type, name, -1);
+}
+static void *__stdcall ResFindResourceExA(HMODULE hModule, const char *type, const char *name, WORD lang) ALIGN_STACK;
+static void *__stdcall ResFindResourceExA(HMODULE hModule, const char *type, const char *name, WORD lang)
+{
+    return (void*)findresource(resourcemodule(hModule, __builtin_return_address(0)), type, name, lang);
+}
+static void *__stdcall ResFindResourceExW(HMODULE hModule, const WCHAR16 *type, const WCHAR16 *name, WORD lang) ALIGN_STACK;
+static void *__stdcall ResFindResourceExW(HMODULE hModule, const WCHAR16 *type, const WCHAR16 *name, WORD lang)
+{
+    return (void*)findresource(resourcemodule(hModule, __builtin_return_address(0)), type, name, lang);
+}
+static void *__stdcall ResLoadResource(HMODULE hModule, void *hResInfo) ALIGN_STACK;
+static void *__stdcall ResLoadResource(HMODULE hModule, void *hResInfo)
+{
+    return MyLoadResource(reinterpret_cast<HMODULE>(resourcemodule(hModule, __builtin_return_address(0))), hResInfo);
+}
+static void *__stdcall ResLockResource(void *hResData) ALIGN_STACK;
+static void *__stdcall ResLockResource(void *hResData)
+{
+    return hResData;
+}
+static DWORD __stdcall ResSizeofResource(HMODULE hModule, void *hResInfo) ALIGN_STACK;
+static DWORD __stdcall ResSizeofResource(HMODULE hModule, void *hResInfo)
+{
+    return MySizeofResource(reinterpret_cast<HMODULE>(resourcemodule(hModule, __builtin_return_address(0))), hResInfo);
+}
+static bool __stdcall ResFreeResource(void *hResData) ALIGN_STACK;
+static bool __stdcall ResFreeResource(void *hResData)
+{
+    return false;
+}
+
+// the kernel32 virtual memory functions, as imported by dlls.
+// a reservation is a PROT_NONE, MAP_NORESERVE mapping, committing only changes
+// the protection, so the dll uses memory only for the pages it touches.
+#define MEM_COMMIT                  0x1000
+#define MEM_RESERVE                 0x2000
+#define MEM_DECOMMIT                0x4000
+#define MEM_RELEASE                 0x8000
+#define MEM_RESET                   0x80000
+#define PAGE_NOACCESS               0x01
+#define PAGE_READONLY               0x02
+#define PAGE_READWRITE              0x04
+#define PAGE_WRITECOPY              0x08
+#define PAGE_EXECUTE                0x10
+#define PAGE_EXECUTE_READ           0x20
+#define PAGE_EXECUTE_READWRITE      0x40
+#define PAGE_EXECUTE_WRITECOPY      0x80
+#define ERROR_NOT_ENOUGH_MEMORY     8L
+#define ERROR_INVALID_ADDRESS       487L
+
+// windows aligns reservations to 64k
+#define VM_GRANULARITY  0x10000
 
-    static void *alignedmalloc(int size) ALIGN_STACK { return malloc(size); }
-    static void alignedfree(void *p) ALIGN_STACK { free(p); }
+struct vmregion {
+    vmregion() : size(0), protect(0) { }
+    vmregion(size_t size, DWORD protect) : size(size), protect(protect) { }
+    size_t size;
+    // the protection is tracked per reservation, not per page
+    DWORD protect;
+};
+typedef std::map<uintptr_t,vmregion> vmregionmap;
+vmregionmap g_vmregions;
+std::mutex g_vmlock;
+
+int posixprotection(DWORD protect)
+{
+    // ignore PAGE_GUARD, PAGE_NOCACHE
+    switch(protect&0xff) {
+        case PAGE_NOACCESS: return PROT_NONE;
+        case PAGE_READONLY: return PROT_READ;
+        case PAGE_READWRITE:
+        case PAGE_WRITECOPY: return PROT_READ|PROT_WRITE;
+        case PAGE_EXECUTE:
+        case PAGE_EXECUTE_READ: return PROT_READ|PROT_EXEC;
+        case PAGE_EXECUTE_READWRITE:
+        case PAGE_EXECUTE_WRITECOPY: return PROT_READ|PROT_WRITE|PROT_EXEC;
+    }
+    return -1;
+}
+// the reservation containing [first, last), call with g_vmlock held
+vmregionmap::iterator findvmregion(uintptr_t first, uintptr_t last)
+{
+    vmregionmap::iterator i= g_vmregions.upper_bound(first);
+    if (i==g_vmregions.begin())
+        return g_vmregions.end();
+    --i;
+    if (last>(*i).first+(*i).second.size)
+        return g_vmregions.end();
+    return i;
+}
+static void *__stdcall VmVirtualAlloc(void *addr, size_t size, DWORD type, DWORD protect) ALIGN_STACK;
+static void *__stdcall VmVirtualAlloc(void *addr, size_t size, DWORD type, DWORD protect)
+{
+    int prot= posixprotection(protect);
+    // a reset needs existing pages
+    if (size==0 || prot==-1 || (type&(MEM_COMMIT|MEM_RESERVE|MEM_RESET))==0 || ((type&MEM_RESET) && addr==NULL)) {
+        MySetLastError(ERROR_INVALID_PARAMETER);
+        return NULL;
+    }
+    uintptr_t pagemask= sysconf(_SC_PAGESIZE)-1;
+    std::lock_guard<std::mutex> lock(g_vmlock);
+    if ((type&MEM_RESERVE) || addr==NULL) {
+        uintptr_t base= uintptr_t(addr)&~uintptr_t(VM_GRANULARITY-1);
+        size_t len= (uintptr_t(addr)+size-base+pagemask)&~pagemask;
+        int flags= MAP_PRIVATE|MAP_ANON|MAP_NORESERVE;
+#ifdef MAP_FIXED_NOREPLACE
+        if (base)
+            flags |= MAP_FIXED_NOREPLACE;
 #endif
-    void import()
+        // mmap only aligns to pages, map one granule more, and trim it to 64K alignment
+        size_t maplen= base ? len : len+VM_GRANULARITY;
+        void *p= mmap((void*)base, maplen, (type&MEM_COMMIT) ? prot : PROT_NONE, flags, -1, 0);
+        if (p==MAP_FAILED) {
+            MySetLastError(base ? ERROR_INVALID_ADDRESS : ERROR_NOT_ENOUGH_MEMORY);
+            return NULL;
+        }
+        if (base==0) {
+            uintptr_t aligned= (uintptr_t(p)+VM_GRANULARITY-1)&~uintptr_t(VM_GRANULARITY-1);
+            if (aligned>uintptr_t(p))
+                munmap(p, aligned-uintptr_t(p));
+            if (uintptr_t(p)+maplen>aligned+len)
+                munmap((void*)(aligned+len), uintptr_t(p)+maplen-(aligned+len));
+            p= (void*)aligned;
+        }
+        // without MAP_FIXED_NOREPLACE the address is only a hint
+        if (base && uintptr_t(p)!=base) {
+            munmap(p, len);
+            MySetLastError(ERROR_INVALID_ADDRESS);
+            return NULL;
+        }
+        g_vmregions[uintptr_t(p)]= vmregion(len, (type&MEM_COMMIT) ? protect : PAGE_NOACCESS);
+        logmsg("vm: reserved %p-%p\n", p, (char*)p+len);
+        return p;
+    }
+
+    // commit or reset pages in an existing reservation
+    uintptr_t first= uintptr_t(addr)&~pagemask;
+    uintptr_t last= (uintptr_t(addr)+size+pagemask)&~pagemask;
+    vmregionmap::iterator r= findvmregion(first, last);
+    if (r==g_vmregions.end()) {
+        MySetLastError(ERROR_INVALID_ADDRESS);
+        return NULL;
+    }
+    if (type&MEM_RESET) {
+        // the contents are no longer needed, but the pages stay committed
+        madvise((void*)first, last-first, MADV_DONTNEED);
+        return addr;
+    }
+    // pages which were decommitted read back as zero, like on windows
+    if (mprotect((void*)first, last-first, prot)) {
+        MySetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return NULL;
+    }
+    (*r).second.protect= protect;
+    return (void*)first;
+}
+static int __stdcall VmVirtualFree(void *addr, size_t size, DWORD type) ALIGN_STACK;
+static int __stdcall VmVirtualFree(void *addr, size_t size, DWORD type)
+{
+    uintptr_t pagemask= sysconf(_SC_PAGESIZE)-1;
+    std::lock_guard<std::mutex> lock(g_vmlock);
+    if (type==MEM_RELEASE) {
+        // only whole reservations can be released
+        vmregionmap::iterator r= g_vmregions.find(uintptr_t(addr));
+        if (size!=0 || r==g_vmregions.end()) {
+            MySetLastError(ERROR_INVALID_PARAMETER);
+            return 0;
+        }
+        munmap(addr, (*r).second.size);
+        g_vmregions.erase(r);
+        logmsg("vm: released %p\n", addr);
+        return 1;
+    }
+    if (type!=MEM_DECOMMIT) {
+        MySetLastError(ERROR_INVALID_PARAMETER);
+        return 0;
+    }
+    uintptr_t first= uintptr_t(addr)&~pagemask;
+    vmregionmap::iterator r= findvmregion(first, first+1);
+    if (r==g_vmregions.end()) {
+        MySetLastError(ERROR_INVALID_ADDRESS);
+        return 0;
+    }
+    // size 0 decommits up to the end of the reservation
+    uintptr_t last= size ? (uintptr_t(addr)+size+pagemask)&~pagemask : (*r).first+(*r).second.size;
+    if (last>(*r).first+(*r).second.size) {
+        MySetLastError(ERROR_INVALID_ADDRESS);
+        return 0;
+    }
+    // returns the pages to the os, they read back as zero when committed again
+    madvise((void*)first, last-first, MADV_DONTNEED);
+    mprotect((void*)first, last-first, PROT_NONE);
+    return 1;
+}
+static int __stdcall VmVirtualProtect(void *addr, size_t size, DWORD protect, DWORD *oldprotect) ALIGN_STACK;
+static int __stdcall VmVirtualProtect(void *addr, size_t size, DWORD protect, DWORD *oldprotect)
+{
+    int prot= posixprotection(protect);
+    if (size==0 || prot==-1 || oldprotect==NULL) {
+        MySetLastError(ERROR_INVALID_PARAMETER);
+        return 0;
+    }
+    uintptr_t pagemask= sysconf(_SC_PAGESIZE)-1;
+    uintptr_t first= uintptr_t(addr)&~pagemask;
+    uintptr_t last= (uintptr_t(addr)+size+pagemask)&~pagemask;
+    std::lock_guard<std::mutex> lock(g_vmlock);
+    if (mprotect((void*)first, last-first, prot)) {
+        MySetLastError(ERROR_INVALID_ADDRESS);
+        return 0;
+    }
+    vmregionmap::iterator r= findvmregion(first, last);
+    if (r!=g_vmregions.end()) {
+        *oldprotect= (*r).second.protect;
+        (*r).second.protect= protect;
+    }
+    else {
+        // dlls also change the protection of their own image, which is mapped rwx
+        *oldprotect= PAGE_EXECUTE_READWRITE;
+    }
+    return 1;
+}
+
+// the kernel32 timing functions.
+// clock_gettime is served from the vdso, so these do not enter the kernel.
+static int __stdcall TmQueryPerformanceCounter(int64_t *count) ALIGN_STACK;
+static int __stdcall TmQueryPerformanceCounter(int64_t *count)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    *count= int64_t(ts.tv_sec)*1000000000+ts.tv_nsec;
+    return 1;
+}
+static int __stdcall TmQueryPerformanceFrequency(int64_t *freq) ALIGN_STACK;
+static int __stdcall TmQueryPerformanceFrequency(int64_t *freq)
+{
+    // the counter is in nanoseconds
+    *freq= 1000000000;
+    return 1;
+}
+uint64_t tickcount()
+{
+    struct timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+    // the tick count only has a resolution of 10 to 16 msec on windows
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return uint64_t(ts.tv_sec)*1000+ts.tv_nsec/1000000;
+}
+static DWORD __stdcall TmGetTickCount() ALIGN_STACK;
+static DWORD __stdcall TmGetTickCount()
+{
+    return DWORD(tickcount());
+}
+static uint64_t __stdcall TmGetTickCount64() ALIGN_STACK;
+static uint64_t __stdcall TmGetTickCount64()
+{
+    return tickcount();
+}
+
+struct importentry {
+    const char *name;
+    void *fn;
+};
+static const importentry g_imports[]= {
+    { "FindResourceA", (void*)ResFindResourceA },
+    { "FindResourceW", (void*)ResFindResourceW },
+    { "FindResourceExA", (void*)ResFindResourceExA },
+    { "FindResourceExW", (void*)ResFindResourceExW },
+    { "LoadResource", (void*)ResLoadResource },
+    { "LockResource", (void*)ResLockResource },
+    { "SizeofResource", (void*)ResSizeofResource },
+    { "FreeResource", (void*)ResFreeResource },
+    { "VirtualAlloc", (void*)VmVirtualAlloc },
+    { "VirtualFree", (void*)VmVirtualFree },
+    { "VirtualProtect", (void*)VmVirtualProtect },
+    { "QueryPerformanceCounter", (void*)TmQueryPerformanceCounter },
+    { "QueryPerformanceFrequency", (void*)TmQueryPerformanceFrequency },
+    { "GetTickCount", (void*)TmGetTickCount },
+    { "GetTickCount64", (void*)TmGetTickCount64 },
+};
+void *findimport(const std::string& name)
+{
+    for (unsigned i=0 ; i<sizeof(g_imports)/sizeof(*g_imports) ; i++)
+        if (name==g_imports[i].name)
+            return g_imports[i].fn;
+    return NULL;
+}
+#else
+void *findimport(const std::string& name)
+{
+    return NULL;
+}
+#endif
+
+#ifndef _WIN32_WCE
+// resolves dll names to files, searching like windows does: the directory
+// of the executable, the current directory, then PATH.
+// MySetDllSearchPath replaces this list.
+//
+// on linux results, including 'not found', are cached. the search directories
+// are watched with inotify, any change in them drops the cache.
+class DllSearchPath {
+public:
+    DllSearchPath()
+        : _configured(false), _cacheable(false), _inotify(-1)
     {
-        for (unsigned i=0 ; i<_pe.importcount() ; i++)
+        memset(&_stats, 0, sizeof(_stats));
+    }
+    ~DllSearchPath()
+    {
+        closewatches();
+    }
+    // 'path' is ':' or ';' separated, NULL selects the default search order
+    void configure(const char *path)
+    {
+        std::lock_guard<std::mutex> lock(_mtx);
+        setdirs(path ? splitpath(path) : defaultdirs());
+    }
+    std::string find(const std::string& name)
+    {
+        std::lock_guard<std::mutex> lock(_mtx);
+        if (!_configured)
+            setdirs(defaultdirs());
+        _stats.lookups++;
+
+        // names with a path are not searched
+        if (name.find_first_of("/\\") != name.npos) {
+            if (fileexists(name))
+                return name;
+            throw loadererror("not found");
+        }
+        checkwatches();
+        if (_cacheable) {
+            std::map<std::string,std::string>::iterator i= _found.find(name);
+            if (i!=_found.end()) {
+                _stats.cachehits++;
+                return (*i).second;
+            }
+            if (_missing.find(name)!=_missing.end()) {
+                _stats.negativehits++;
+                throw loadererror("not found");
+            }
+        }
+        for (unsigned i=0 ; i<_dirs.size() ; i++)
         {
-// DisableThreadLibraryCalls
-// SetLastError
-// __CppXcptFilter
-// __dllonexit
-// _adjust_fdiv
-// _assert
-// _except_handler3
-// _initterm
-// _onexit
+            std::string path= _dirs[i]+"/"+name;
+            logmsg("dll:searching %s\n", path.c_str());
+            if (fileexists(path)) {
+                if (_cacheable)
+                    _found[name]= path;
+                return path;
+            }
+        }
+        if (_cacheable)
+            _missing[name]= true;
+        throw loadererror("not found");
+    }
+    MyDllSearchStats stats()
+    {
+        std::lock_guard<std::mutex> lock(_mtx);
+        return _stats;
+    }
+private:
+    static std::vector<std::string> splitpath(const std::string& searchpath)
+    {
+        std::vector<std::string> dirs;
+        char sepchar= (searchpath.find(';')!=searchpath.npos) ? ';' : ':';
+        size_t j= 0;
+        while (j<=searchpath.size())
+        {
+            size_t i= searchpath.find(sepchar, j);
+            if (i==searchpath.npos)
+                i= searchpath.size();
+            if (i>j)
+                dirs.push_back(searchpath.substr(j, i-j));
+            j= i+1;
+        }
+        return dirs;
+    }
+    static std::vector<std::string> defaultdirs()
+    {
+        std::vector<std::string> dirs;
+#ifdef __linux__
+        char exe[1024];
+        ssize_t n= readlink("/proc/self/exe", exe, sizeof(exe)-1);
+        if (n>0) {
+            std::string exepath(exe, n);
+            dirs.push_back(exepath.substr(0, exepath.find_last_of('/')));
+        }
+#endif
+        // the current directory as it is now, a later chdir does not change the search
+        char cwd[1024];
+        if (getcwd(cwd, sizeof(cwd)))
+            dirs.push_back(cwd);
+        else
+            dirs.push_back(".");
+        const char *path= getenv("PATH");
+        if (path) {
+            std::vector<std::string> pathdirs= splitpath(path);
+            dirs.insert(dirs.end(), pathdirs.begin(), pathdirs.end());
+        }
+        return dirs;
+    }
+    void setdirs(const std::vector<std::string>& dirs)
+    {
+        _dirs= dirs;
+        _configured= true;
+        setwatches();
+    }
+
+    // only regular files count, unreadable entries are skipped
+    bool fileexists(const std::string& path)
+    {
+        _stats.stats++;
+        struct stat st;
+        if (-1==stat(path.c_str(), &st))
+            return false;
+        return (st.st_mode&S_IFMT)==S_IFREG;
+    }
+
+    void invalidate()
+    {
+        _found.clear();
+        _missing.clear();
+        _stats.invalidations++;
+    }
+#ifdef __linux__
+    // a missing search directory is handled by watching its parent for its creation.
+    // when not every directory can be watched, nothing is cached.
+    void setwatches()
+    {
+        closewatches();
+        invalidate();
+        _inotify= inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+        if (_inotify==-1)
+            return;
+        const uint32_t dirmask= IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO|IN_ATTRIB|IN_DELETE_SELF|IN_MOVE_SELF;
+        for (unsigned i=0 ; i<_dirs.size() ; i++)
+        {
+            if (-1!=inotify_add_watch(_inotify, _dirs[i].c_str(), dirmask))
+                continue;
+            if (errno!=ENOENT)
+                return;
+            std::string parent= _dirs[i].substr(0, _dirs[i].find_last_of('/'));
+            if (parent.empty() || parent==_dirs[i] || -1==inotify_add_watch(_inotify, parent.c_str(), IN_CREATE|IN_MOVED_TO))
+                return;
+        }
+        _cacheable= true;
+    }
+    void closewatches()
+    {
+        if (_inotify!=-1)
+            close(_inotify);
+        _inotify= -1;
+        _cacheable= false;
+    }
+    // drains pending events, any event drops the cache. watches are reinstalled
+    // when a directory was removed, or the event queue overflowed.
+    void checkwatches()
+    {
+        if (_inotify==-1)
+            return;
+        bool changed= false;
+        bool rewatch= false;
+        char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        while (true) {
+            ssize_t n= read(_inotify, buf, sizeof(buf));
+            if (n<=0)
+                break;
+            changed= true;
+            for (char *p= buf ; p<buf+n ; p+= sizeof(struct inotify_event)+((struct inotify_event*)p)->len)
+            {
+                const struct inotify_event *ev= (const struct inotify_event*)p;
+                if (ev->mask&(IN_IGNORED|IN_Q_OVERFLOW|IN_DELETE_SELF|IN_MOVE_SELF|IN_CREATE|IN_MOVED_TO))
+                    rewatch= true;
+            }
+        }
+        if (rewatch)
+            setwatches();
+        else if (changed)
+            invalidate();
+    }
+#else
+    void setwatches() { invalidate(); }
+    void closewatches() { }
+    void checkwatches() { }
+#endif
 
-            uint32_t *p= (uint32_t*)&_data[_pe.importitem(i).virtualaddress-_base_va];
+    std::mutex _mtx;
+    std::vector<std::string> _dirs;
+    std::map<std::string,std::string> _found;
+    std::map<std::string,bool> _missing;
+    MyDllSearchStats _stats;
+    bool _configured;
+    bool _cacheable;
+    int _inotify;
+};
+DllSearchPath g_searchpath;
+#endif
+std::string find_dll(const std::string& name)
+{
 #ifndef _WIN32_WCE
-            // todo: add importer object, which knows where to find external functions
-            if (_pe.importitem(i).name=="LocalAlloc") *p=(uint32_t)LocalAlloc;
-            else if (_pe.importitem(i).name=="LocalFree") *p=(uint32_t)LocalFree;
-            else if (_pe.importitem(i).name=="DisableThreadLibraryCalls") *p=(uint32_t)DisableThreadLibraryCalls;
-            else if (_pe.importitem(i).name=="SetLastError") *p=(uint32_t)SetLastError;
-            else if (_pe.importitem(i).name=="malloc") *p=(uint32_t)alignedmalloc;
-            else if (_pe.importitem(i).name=="free") *p=(uint32_t)alignedfree;
-            else if (_pe.importitem(i).name=="_adjust_fdiv") *p=(uint32_t)undefined;
-            else *p=(uint32_t)dummy;
+    return g_searchpath.find(name);
 #else
-            // ... replace some imports with kernel variants
+    return (name[0]=='/' || name[0]=='\\')?name: std::string("\\windows\\")+name;
+#endif
+}
+
+#ifndef _WIN32
+// freed modules which were loaded by MyLoadLibrary, kept loaded for reuse.
+// a retained module is revived by the next MyLoadLibrary of the same, unchanged
+// file. the least recently freed are evicted when the images exceed the budget,
+// and modules idle for longer than the timeout are evicted on the next call.
+class ModuleCache {
+public:
+    // identifies the file a module was loaded from
+    struct fileid {
+        fileid() : dev(0), ino(0), size(0), mtime(0) { }
+        std::string name;
+        uint64_t dev, ino, size;
+        int64_t mtime;      // in nanoseconds
+
+        bool operator==(const fileid& id) const
+        {
+            return dev==id.dev && ino==id.ino && size==id.size && mtime==id.mtime && name==id.name;
+        }
+    };
+
+    ModuleCache()
+        : _budget(0), _idlemsec(0)
+    {
+        memset(&_stats, 0, sizeof(_stats));
+    }
+    void configure(uint64_t budget, unsigned idlemsec)
+    {
+        std::vector<DllModule*> victims;
+        {
+            std::lock_guard<std::mutex> lock(_mtx);
+            _budget= budget;
+            _idlemsec= idlemsec;
+            if (_budget==0)
+                _live.clear();
+            trim(victims);
+        }
+        release(victims);
+    }
+    // returns a retained module for 'filename', or NULL.
+    // when retention is enabled, 'id' is filled in for track.
+    DllModule *revive(const std::string& filename, fileid& id)
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mtx);
+            if (_budget==0)
+                return NULL;
+        }
+        // outside the lock, stat can block on a slow filesystem
+        struct stat st;
+        if (stat(filename.c_str(), &st))
+            return NULL;
+        id.name= filename;
+        id.dev= st.st_dev;
+        id.ino= st.st_ino;
+        id.size= st.st_size;
+        id.mtime= mtimens(st);
+
+        std::vector<DllModule*> victims;
+        DllModule *dll= NULL;
+        {
+            std::lock_guard<std::mutex> lock(_mtx);
+            trim(victims);
+            for (retainedlist::iterator i= _retained.begin() ; i!=_retained.end() ; ++i)
+                if ((*i).id==id) {
+                    dll= (*i).dll;
+                    _stats.retainedbytes -= dll->imagesize();
+                    _stats.revivals++;
+                    _retained.erase(i);
+                    _live[dll]= id;
+                    break;
+                }
+        }
+        release(victims);
+        return dll;
+    }
+    void track(DllModule *dll, const fileid& id)
+    {
+        std::lock_guard<std::mutex> lock(_mtx);
+        if (_budget && !id.name.empty())
+            _live[dll]= id;
+    }
+    // returns false when 'dll' is not retained, and should be deleted
+    bool retain(DllModule *dll)
+    {
+        std::vector<DllModule*> victims;
+        {
+            std::lock_guard<std::mutex> lock(_mtx);
+            livemap::iterator i= _live.find(dll);
+            if (i==_live.end())
+                return false;
+            _retained.push_front(entry(dll, (*i).second));
+            _live.erase(i);
+            _stats.retainedbytes += dll->imagesize();
+            trim(victims);
+        }
+        release(victims);
+        return true;
+    }
+    void getstats(MyRetentionStats *stats)
+    {
+        std::vector<DllModule*> victims;
+        {
+            std::lock_guard<std::mutex> lock(_mtx);
+            trim(victims);
+            *stats= _stats;
+            stats->retained= _retained.size();
+        }
+        release(victims);
+    }
+private:
+    typedef std::chrono::steady_clock clock;
+    struct entry {
+        entry(DllModule *dll, const fileid& id) : dll(dll), id(id), freed(clock::now()) { }
+        DllModule *dll;
+        fileid id;
+        clock::time_point freed;
+    };
+    typedef std::list<entry> retainedlist;
+    typedef std::map<DllModule*,fileid> livemap;
+
+    // moves expired modules, and those over the budget, to 'victims'.
+    // the most recently freed are at the front. caller holds _mtx
+    void trim(std::vector<DllModule*>& victims)
+    {
+        clock::time_point expiry= clock::now()-std::chrono::milliseconds(_idlemsec);
+        while (!_retained.empty()) {
+            const entry& last= _retained.back();
+            if (_stats.retainedbytes>_budget)
+                _stats.evictions++;
+            else if (_idlemsec && last.freed<expiry)
+                _stats.expirations++;
+            else
+                break;
+            _stats.retainedbytes -= last.dll->imagesize();
+            victims.push_back(last.dll);
+            _retained.pop_back();
+        }
+    }
+    // unloading happens outside the lock
+    static void release(const std::vector<DllModule*>& victims)
+    {
+        for (unsigned i=0 ; i<victims.size() ; i++) {
+            logmsg("dll:evicting %s\n", victims[i]->name().c_str());
+            delete victims[i];
+        }
+    }
+
+    std::mutex _mtx;
+    uint64_t _budget;
+    unsigned _idlemsec;
+    retainedlist _retained;
+    livemap _live;          // modules loaded by path, while retention was enabled
+    MyRetentionStats _stats;
+};
+ModuleCache g_modulecache;
+#endif
+
+HMODULE MyLoadLibrary(const char*dllname)
+{
+    try {
+        std::string dllfilename= find_dll(dllname);
+#ifndef _WIN32
+        ModuleCache::fileid id;
+        DllModule *retained= g_modulecache.revive(dllfilename, id);
+        if (retained) {
+            logmsg("dll:reviving %s\n", dllfilename.c_str());
+            registermodule(retained);
+            return reinterpret_cast<HMODULE>(retained);
+        }
+#endif
+        logmsg("dll:loading %s\n", dllfilename.c_str());
+        DllModule *dll= new DllModule(new posixfile(dllfilename), dllfilename, true);
+#ifndef _WIN32
+        g_modulecache.track(dll, id);
 #endif
-            logmsg("dll:import %d: %08x:=%08x   ord %4d %s %s\n", i, _pe.importitem(i).virtualaddress, *p, _pe.importitem(i).ordinal, _pe.importitem(i).dllname.c_str(), _pe.importitem(i).name.c_str());
-        }
+        registermodule(dll);
+
+//      DLLENTRYPOINT ep= dll->getentrypoint();
+//      logmsg("loadlib: entrypoint=%08lx\n", ep);
+//      ep(reinterpret_cast<HMODULE>(dll), 0, 0);
+
+        return reinterpret_cast<HMODULE>(dll);
     }
-    void *getprocbyname(const char *procname) const
+    catch(...)
     {
-        name2ptrmap::const_iterator i= _exportsbyname.find(procname);
-        if (i==_exportsbyname.end()) {
-            MySetLastError(ERROR_PROC_NOT_FOUND);
-            return NULL;
-        }
-        return TranslateAddress((*i).second);
+        MySetLastError(ERROR_MOD_NOT_FOUND);
+        return NULLMODULE;
     }
-    void *getprocbyordinal(unsigned ord) const
+}
+HMODULE MyLoadLibraryFromMemory(const void *image, size_t size)
+{
+    try {
+        char name[32];
+        snprintf(name, sizeof(name), "mem%p.dll", image);
+        DllModule *dll= new DllModule(new memoryfile(image, size), name, true);
+        registermodule(dll);
+        return reinterpret_cast<HMODULE>(dll);
+    }
+    catch(...)
     {
-        ord2ptrmap::const_iterator i= _exportsbyordinal.find(ord);
-        if (i==_exportsbyordinal.end()) {
-            MySetLastError(ERROR_PROC_NOT_FOUND);
-            return NULL;
+        MySetLastError(ERROR_MOD_NOT_FOUND);
+        return NULLMODULE;
+    }
+}
+#ifndef _WIN32
+HMODULE MyLoadSharedLibrary(const char*dllname, const char*shmname)
+{
+    try {
+        std::string dllfilename= find_dll(dllname);
+        struct stat st;
+        if (stat(dllfilename.c_str(), &st))
+            throw posixerror("stat", dllfilename);
+        std::string name;
+        if (shmname) {
+            name= shmname;
+            if (name[0]!='/')
+                name.insert(0, "/");
+        }
+        else {
+            char buf[64];
+            snprintf(buf, sizeof(buf), "-%llx-%llx", (unsigned long long)st.st_dev, (unsigned long long)st.st_ino);
+            std::string base= dllfilename.substr(dllfilename.find_last_of("/\\")+1);
+            name= "/dllloader-"+base+buf;
         }
-        return TranslateAddress((*i).second);
+        logmsg("dll:loading %s shared as %s\n", dllfilename.c_str(), name.c_str());
+        SharedImage shared(name, st);
+        DllModule *dll= new DllModule(new posixfile(dllfilename), dllfilename, true, &shared);
+        registermodule(dll);
+        return reinterpret_cast<HMODULE>(dll);
     }
-
-    void *TranslateAddress(const void*p) const
+    catch(...)
     {
-        return reinterpret_cast<void*>(
-                reinterpret_cast<uint32_t>(p)
-                -reinterpret_cast<uint32_t>(&_data[0])
-                +_baseaddr
-                );
+        MySetLastError(ERROR_MOD_NOT_FOUND);
+        return NULLMODULE;
     }
-    size_t size() const { return _data.size(); }
-    const uint8_t* data() const { return &_data[0]; }
+}
 
-    DLLENTRYPOINT getentrypoint() const
-    {
-        logmsg("getep: eva=%08lx base=%08lx data=%08lx\n", _pe.entryva(), _base_va, &_data[_pe.entryva()-_base_va]);
-        return reinterpret_cast<DLLENTRYPOINT>(TranslateAddress(&_data[_pe.entryva()-_base_va]));
-    }
-private:
-    name2ptrmap _exportsbyname;
-    ord2ptrmap _exportsbyordinal;
-    ByteVector _data;
-};
-#ifndef _WIN32_WCE
-bool fileexists(const std::string& path)
+HMODULE MyLoadLibraryFromFd(int fd)
 {
-    struct stat st;
-    if (-1==stat(path.c_str(), &st)) {
-        if (errno==ENOENT)
-            return false;
-        throw posixerror("stat", path);
-    }
-
-    return (st.st_mode&S_IFMT)==S_IFREG;
-}
+    try {
+        char name[64];
+        snprintf(name, sizeof(name), "fd%d.dll", fd);
+#ifdef __linux__
+        // use the real filename when there is one
+        char link[64];
+        snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+        ssize_t n= readlink(link, name, sizeof(name)-1);
+        if (n>0)
+            name[n]= 0;
+        else
+            snprintf(name, sizeof(name), "fd%d.dll", fd);
 #endif
-std::string find_dll(const std::string& name)
-{
-#ifndef _WIN32_WCE
-    if (fileexists(name))
-        return name;
-    std::string searchpath= getenv("PATH");
-    char sepchar= (searchpath.find(';')!=searchpath.npos) ? ';' : ':';
-
-    for (size_t i=searchpath.find(sepchar), j=0 ; j!=searchpath.npos ; j=i, i=searchpath.find(sepchar, i+1))
+        DllModule *dll= new DllModule(new fdfile(fd), name, true);
+        registermodule(dll);
+        return reinterpret_cast<HMODULE>(dll);
+    }
+    catch(...)
     {
-        std::string path=searchpath.substr(j==0?0:j+1, (i==searchpath.npos || j==0)? i : i-j-1);
-        logmsg("dll:searching %s\n", path.c_str());
-        if (fileexists(path+"/"+name))
-            return path+"/"+name;
+        MySetLastError(ERROR_MOD_NOT_FOUND);
+        return NULLMODULE;
     }
-    throw loadererror("not found");
-#else
-    return (name[0]=='/' || name[0]=='\\')?name: std::string("\\windows\\")+name;
-#endif
 }
-HMODULE MyLoadLibrary(const char*dllname)
+HMODULE MyLoadLibraryAt(const char*dllname, void *dest, size_t size, size_t *used)
 {
+    size_t pagemask= sysconf(_SC_PAGESIZE)-1;
+    if (dest==NULL || (uintptr_t(dest)&pagemask)) {
+        MySetLastError(ERROR_INVALID_PARAMETER);
+        return NULLMODULE;
+    }
     try {
         std::string dllfilename= find_dll(dllname);
-        logmsg("dll:loading %s\n", dllfilename.c_str());
-        DllModule *dll= new DllModule(dllfilename, true);
-
-//      DLLENTRYPOINT ep= dll->getentrypoint();
-//      logmsg("loadlib: entrypoint=%08lx\n", ep);
-//      ep(reinterpret_cast<HMODULE>(dll), 0, 0);
-
+        logmsg("dll:loading %s at %p\n", dllfilename.c_str(), dest);
+        DllModule *dll= new DllModule(new posixfile(dllfilename), dllfilename, true, NULL, (uint8_t*)dest, size);
+        registermodule(dll);
+        if (used)
+            *used= (dll->size()+pagemask)&~pagemask;
         return reinterpret_cast<HMODULE>(dll);
     }
+    catch(const insufficientmemory& e)
+    {
+        if (used)
+            *used= (e.needed()+pagemask)&~pagemask;
+        MySetLastError(ERROR_INSUFFICIENT_BUFFER);
+        return NULLMODULE;
+    }
     catch(...)
     {
         MySetLastError(ERROR_MOD_NOT_FOUND);
-        return NULL;
+        return NULLMODULE;
     }
 }
+#endif
 #ifdef _WIN32_WCE
 
 #define AllocPhysMem (*(LPVOID (*)(DWORD cbSize, DWORD fdwProtect, DWORD dwAlignmentMask, DWORD dwFlags, PULONG pPhysicalAddress))0xf000fd60)
@@ -816,14 +3635,14 @@ HMODULE MyLoadKernelLibrary(const char*dllname)
     try {
         std::string dllfilename= find_dll(dllname);
         logmsg("dll:loading %s\n", dllfilename.c_str());
-        DllModule *dll= new DllModule(dllfilename, false);
+        DllModule *dll= new DllModule(new posixfile(dllfilename), dllfilename, false);
 
         DWORD physaddr=0;
         void *vptr= AllocPhysMem(dll->size(), PAGE_EXECUTE_READWRITE, 0, 0, &physaddr);
         if (vptr==NULL) {
             MySetLastError(ERROR_OUTOFMEMORY);
             delete dll;
-            return NULL;
+            return NULLMODULE;
         }
         logmsg("klib: relocating to %08lx / phys %08lx\n", vptr, physaddr);
         dll->relocate(PhysToVirt(physaddr));
@@ -841,34 +3660,202 @@ HMODULE MyLoadKernelLibrary(const char*dllname)
     catch(...)
     {
         MySetLastError(ERROR_MOD_NOT_FOUND);
-        return NULL;
+        return NULLMODULE;
     }
 }
 #endif
 
-FARPROC MyGetProcAddress(HMODULE hModule, const char*procname)
+// dlls being loaded in the background. their handle is the address at which
+// the DllModule is constructed, so it stays the same after loading.
+struct pendingload {
+    pendingload() : done(false), error(0) { }
+    bool done;
+    unsigned error;
+};
+typedef std::map<void*,pendingload> pendingmap;
+pendingmap g_pending;
+std::mutex g_pendinglock;
+std::condition_variable g_pendingdone;
+std::atomic<unsigned> g_pendingcount;   // lets dllmodule skip the lock when nothing is loading
+
+// waits while 'mem' is still being loaded.
+// returns false when that load failed, with the lasterror set.
+// with 'discardfailed' a failed load is forgotten, and its memory released,
+// the lasterror is left alone, discarding it succeeds.
+bool waitpending(void *mem, bool discardfailed)
+{
+    std::unique_lock<std::mutex> lock(g_pendinglock);
+    while (true) {
+        pendingmap::iterator i= g_pending.find(mem);
+        if (i==g_pending.end())
+            return true;
+        if ((*i).second.done) {
+            unsigned error= (*i).second.error;
+            if (error==0 || discardfailed) {
+                g_pending.erase(i);
+                g_pendingcount--;
+            }
+            if (error==0)
+                return true;
+            if (discardfailed)
+                operator delete(mem);
+            else
+                MySetLastError(error);
+            return false;
+        }
+        g_pendingdone.wait(lock);
+    }
+}
+void backgroundload(void *mem, imagesource *src, const std::string& dllfilename)
+{
+    unsigned error= 0;
+    try {
+        DllModule *dll= new (mem) DllModule(src, dllfilename, true);
+        registermodule(dll);
+    }
+    catch(...)
+    {
+        error= ERROR_MOD_NOT_FOUND;
+    }
+    std::lock_guard<std::mutex> lock(g_pendinglock);
+    g_pending[mem].done= true;
+    g_pending[mem].error= error;
+    g_pendingdone.notify_all();
+}
+
+HMODULE MyLoadLibraryAsync(const char*dllname)
+{
+    void *mem= NULL;
+    try {
+        std::string dllfilename= find_dll(dllname);
+        std::unique_ptr<imagesource> src(new posixfile(dllfilename));
+#ifdef POSIX_FADV_WILLNEED
+        // start reading the whole file now, so the parser's reads hit the page cache
+        posix_fadvise(src->fd(), 0, 0, POSIX_FADV_WILLNEED);
+#endif
+        mem= operator new(sizeof(DllModule));
+        {
+            std::lock_guard<std::mutex> lock(g_pendinglock);
+            g_pending[mem]= pendingload();
+            g_pendingcount++;
+        }
+        imagesource *f= src.release();
+        try {
+            std::thread(backgroundload, mem, f, dllfilename).detach();
+        }
+        catch(...)
+        {
+            // no thread available, load it here
+            backgroundload(mem, f, dllfilename);
+        }
+        return reinterpret_cast<HMODULE>(mem);
+    }
+    catch(...)
+    {
+        if (mem) {
+            std::lock_guard<std::mutex> lock(g_pendinglock);
+            g_pending.erase(mem);
+            g_pendingcount--;
+            operator delete(mem);
+        }
+        MySetLastError(ERROR_MOD_NOT_FOUND);
+        return NULLMODULE;
+    }
+}
+
+DllModule *dllmodule(HMODULE hModule)
 {
     DllModule *dll= reinterpret_cast<DllModule*>(hModule);
-    if (dll==NULL) {
+    if (dll==NULL)
         MySetLastError(ERROR_INVALID_HANDLE);
+    else if (g_pendingcount && !waitpending(dll, false))
         return NULL;
-    }
-    unsigned ord= reinterpret_cast<unsigned>(procname);
+    return dll;
+}
+
+bool MyWaitLibrary(HMODULE hModule)
+{
+    return dllmodule(hModule)!=NULL;
+}
+
+FARPROC MyGetProcAddress(HMODULE hModule, const char*procname)
+{
+    DllModule *dll= dllmodule(hModule);
+    if (dll==NULL)
+        return NULL;
+    uintptr_t ord= reinterpret_cast<uintptr_t>(procname);
     // note: in windows land, pointers are always >=0x11000, not so in the rest of the world.
     // so this method of passing either a string, or a 16bit int does not work properly everywhere.
-    if (ord<0x1000)
-        return (FARPROC)dll->getprocbyordinal(ord);
-    return (FARPROC)dll->getprocbyname(procname);
+    void *proc= (ord<0x1000) ? dll->getprocbyordinal(ord) : dll->getprocbyname(procname);
+#ifndef _WIN32
+    proc= dll->nodelocal(proc);
+#endif
+#ifdef HAVE_PROFILE_TRAMPOLINES
+    if (g_profiling && proc)
+        return (FARPROC)dll->profiler().trampoline(proc, ord<0x1000 ? NULL : procname, ord<0x1000 ? ord : 0);
+#endif
+    return (FARPROC)proc;
+}
+
+FARPROC MyGetProcAddressByOrdinal(HMODULE hModule, unsigned ordinal)
+{
+    DllModule *dll= dllmodule(hModule);
+    if (dll==NULL)
+        return NULL;
+    void *proc= dll->getprocbyordinal(ordinal);
+#ifndef _WIN32
+    proc= dll->nodelocal(proc);
+#endif
+#ifdef HAVE_PROFILE_TRAMPOLINES
+    if (g_profiling && proc)
+        return (FARPROC)dll->profiler().trampoline(proc, NULL, ordinal);
+#endif
+    return (FARPROC)proc;
+}
+
+unsigned MyGetProcAddresses(HMODULE hModule, MyProcRequest *requests, unsigned count)
+{
+    DllModule *dll= dllmodule(hModule);
+    if (dll==NULL)
+        return 0;
+    unsigned found= dll->resolve(requests, count);
+#ifndef _WIN32
+    if (dll->replicacount())
+        for (unsigned i=0 ; i<count ; i++)
+            requests[i].proc= (FARPROC)dll->nodelocal((void*)requests[i].proc);
+#endif
+#ifdef HAVE_PROFILE_TRAMPOLINES
+    if (g_profiling)
+        for (unsigned i=0 ; i<count ; i++)
+            if (requests[i].proc)
+                requests[i].proc= (FARPROC)dll->profiler().trampoline((void*)requests[i].proc, requests[i].name, requests[i].name ? 0 : requests[i].ordinal);
+#endif
+    return found;
+}
+
+bool MyGetExportTable(HMODULE hModule, MyExportTable *table)
+{
+    DllModule *dll= dllmodule(hModule);
+    if (dll==NULL)
+        return false;
+    dll->exporttable(table);
+    return true;
 }
 
 bool MyFreeLibrary(HMODULE hModule)
 {
-    DllModule *dll= reinterpret_cast<DllModule*>(hModule);
-    if (dll==NULL) {
-        MySetLastError(ERROR_INVALID_HANDLE);
+    // a failed background load has nothing to unload
+    if (hModule && g_pendingcount && !waitpending(reinterpret_cast<void*>(hModule), true))
+        return true;
+    DllModule *dll= dllmodule(hModule);
+    if (dll==NULL)
         return false;
-    }
     try {
+        unregistermodule(dll);
+#ifndef _WIN32
+        if (g_modulecache.retain(dll))
+            return true;
+#endif
         delete dll;
         return true;
     }
@@ -878,3 +3865,256 @@ bool MyFreeLibrary(HMODULE hModule)
         return false;
     }
 }
+
+bool MyGetModuleInfo(HMODULE hModule, MyModuleInfo *info)
+{
+    DllModule *dll= dllmodule(hModule);
+    if (dll==NULL)
+        return false;
+    info->name= dll->name().c_str();
+    info->base= dll->imagebase();
+    info->size= dll->imagesize();
+    info->preferredbase= dll->preferredbase();
+    info->relocated= dll->relocated();
+    info->fixups= dll->fixupcount();
+    info->shared= dll->shared();
+    info->discarded= dll->discardedbytes();
+    info->metadatafreed= dll->metadatabytes();
+#ifndef _WIN32
+    info->replicas= dll->replicacount();
+#else
+    info->replicas= 0;
+#endif
+    return true;
+}
+
+void MyEnableProfiling(bool enable)
+{
+    g_profiling= enable;
+}
+
+#ifndef _WIN32
+void MyEnableNumaReplicas(bool enable)
+{
+    g_numareplicas= enable;
+}
+bool MySetNumaTopology(const char *nodes)
+{
+    return g_numa.configure(nodes);
+}
+void MySetThreadNumaNode(int node)
+{
+    NumaTopology::setthreadnode(node);
+}
+#endif
+
+unsigned MyGetProfile(HMODULE hModule, MyProcProfile *stats, unsigned maxcount)
+{
+    DllModule *dll= dllmodule(hModule);
+    if (dll==NULL)
+        return 0;
+#ifdef HAVE_PROFILE_TRAMPOLINES
+    return dll->profiler().getstats(stats, maxcount);
+#else
+    return 0;
+#endif
+}
+
+bool MyDumpProfile(HMODULE hModule, FILE *f)
+{
+    DllModule *dll= dllmodule(hModule);
+    if (dll==NULL)
+        return false;
+#ifdef HAVE_PROFILE_TRAMPOLINES
+    std::vector<MyProcProfile> stats(dll->profiler().count());
+    if (stats.empty())
+        return true;
+    stats.resize(dll->profiler().getstats(&stats[0], stats.size()));
+
+    fprintf(f, "%-32s %12s %16s %10s\n", "export", "calls", "cycles", "avg");
+    for (unsigned i=0 ; i<stats.size() ; i++)
+    {
+        const MyProcProfile& st= stats[i];
+        if (st.name)
+            fprintf(f, "%-32s", st.name);
+        else
+            fprintf(f, "ordinal %-24u", st.ordinal);
+        fprintf(f, " %12llu %16llu %10llu\n", (unsigned long long)st.calls, (unsigned long long)st.cycles,
+                (unsigned long long)(st.calls ? st.cycles/st.calls : 0));
+        // histogram: number of calls taking 2^b .. 2^(b+1) cycles
+        for (unsigned b=0 ; b<MYPROFILE_BUCKETS ; b++)
+            if (st.histogram[b])
+                fprintf(f, "    >= 2^%-2u cycles: %llu\n", b, (unsigned long long)st.histogram[b]);
+    }
+#endif
+    return true;
+}
+
+void MyEnablePerfMap(bool enable)
+{
+    std::lock_guard<std::mutex> lock(g_moduleslock);
+    // the dlls loaded while it was off
+    if (enable && !g_perfmap)
+        for (unsigned i=0 ; i<g_modules.size() ; i++)
+            appendperfmap(g_modules[i]);
+    g_perfmap= enable;
+}
+
+// builtin sampler: the SIGPROF handler only stores the interrupted pc,
+// samples are attributed to dll!export when dumped.
+#ifndef _WIN32
+#define MAX_SAMPLES 0x10000
+static uintptr_t g_samples[MAX_SAMPLES];
+static std::atomic<unsigned> g_samplecount;
+
+static uintptr_t samplepc(void *context)
+{
+    ucontext_t *uc= (ucontext_t*)context;
+#if defined(__linux__) && defined(__x86_64__)
+    return uc->uc_mcontext.gregs[REG_RIP];
+#elif defined(__linux__) && defined(__i386__)
+    return uc->uc_mcontext.gregs[REG_EIP];
+#elif defined(__MACH__) && defined(__x86_64__)
+    return uc->uc_mcontext->__ss.__rip;
+#elif defined(__MACH__) && defined(__i386__)
+    return uc->uc_mcontext->__ss.__eip;
+#else
+    return 0;
+#endif
+}
+static void sigprofhandler(int sig, siginfo_t *info, void *context)
+{
+    unsigned i= g_samplecount.fetch_add(1, std::memory_order_relaxed);
+    if (i<MAX_SAMPLES)
+        g_samples[i]= samplepc(context);
+}
+#endif
+
+bool MyStartSampler(unsigned hz)
+{
+#ifndef _WIN32
+    if (hz==0 || hz>1000000)
+        return false;
+    g_samplecount= 0;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction= sigprofhandler;
+    sa.sa_flags= SA_SIGINFO|SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (-1==sigaction(SIGPROF, &sa, NULL))
+        return false;
+
+    struct itimerval tv;
+    // tv_usec must stay below a second
+    tv.it_interval.tv_sec= (1000000/hz)/1000000;
+    tv.it_interval.tv_usec= (1000000/hz)%1000000;
+    tv.it_value= tv.it_interval;
+    return -1!=setitimer(ITIMER_PROF, &tv, NULL);
+#else
+    return false;
+#endif
+}
+
+void MyStopSampler()
+{
+#ifndef _WIN32
+    struct itimerval tv;
+    memset(&tv, 0, sizeof(tv));
+    setitimer(ITIMER_PROF, &tv, NULL);
+    signal(SIGPROF, SIG_IGN);
+#endif
+}
+
+void MyDumpSamples(FILE *f)
+{
+#ifndef _WIN32
+    unsigned total= g_samplecount;
+    unsigned n= std::min(total, unsigned(MAX_SAMPLES));
+
+    std::map<std::string,unsigned> counts;
+    {
+        std::lock_guard<std::mutex> lock(g_moduleslock);
+        for (unsigned i=0 ; i<n ; i++)
+        {
+            DllModule *dll= findmodule(g_samples[i]);
+            if (dll==NULL) {
+                counts["[outside dlls]"]++;
+                continue;
+            }
+            const DllModule::symbolrange *sym= dll->findsymbol(g_samples[i]);
+            counts[sym ? sym->name : dll->name()+"!?"]++;
+        }
+    }
+    std::vector<std::pair<unsigned,std::string> > sorted;
+    for (std::map<std::string,unsigned>::iterator i=counts.begin() ; i!=counts.end() ; ++i)
+        sorted.push_back(std::make_pair((*i).second, (*i).first));
+    std::sort(sorted.rbegin(), sorted.rend());
+
+    fprintf(f, "%u samples", n);
+    if (total>n)
+        fprintf(f, ", %u dropped", total-n);
+    fprintf(f, "\n");
+    for (unsigned i=0 ; i<sorted.size() ; i++)
+        fprintf(f, "%8u %5.1f%%  %s\n", sorted[i].first, 100.0*sorted[i].first/n, sorted[i].second.c_str());
+#endif
+}
+
+#ifndef _WIN32_WCE
+void MySetDllSearchPath(const char *path)
+{
+    g_searchpath.configure(path);
+}
+void MyGetDllSearchStats(MyDllSearchStats *stats)
+{
+    *stats= g_searchpath.stats();
+}
+#ifndef _WIN32
+void MySetModuleRetention(uint64_t budget, unsigned idlemsec)
+{
+    g_modulecache.configure(budget, idlemsec);
+}
+void MyGetRetentionStats(MyRetentionStats *stats)
+{
+    g_modulecache.getstats(stats);
+}
+#endif
+#endif
+
+HRSRC MyFindResource(HMODULE hModule, const char *name, const char *type)
+{
+    return (HRSRC)findresource(dllmodule(hModule), type, name, -1);
+}
+HRSRC MyFindResourceEx(HMODULE hModule, const char *type, const char *name, WORD lang)
+{
+    return (HRSRC)findresource(dllmodule(hModule), type, name, lang);
+}
+HGLOBAL MyLoadResource(HMODULE hModule, HRSRC hResInfo)
+{
+    DllModule *dll= dllmodule(hModule);
+    if (dll==NULL)
+        return NULL;
+    const resourceentry *res= (const resourceentry*)hResInfo;
+    if (!dll->ownsresource(res)) {
+        MySetLastError(ERROR_INVALID_HANDLE);
+        return NULL;
+    }
+    return dll->resourcedata(res);
+}
+LPVOID MyLockResource(HGLOBAL hResData)
+{
+    // resources are never moved, the handle is the pointer into the image
+    return hResData;
+}
+DWORD MySizeofResource(HMODULE hModule, HRSRC hResInfo)
+{
+    DllModule *dll= dllmodule(hModule);
+    if (dll==NULL)
+        return 0;
+    const resourceentry *res= (const resourceentry*)hResInfo;
+    if (!dll->ownsresource(res)) {
+        MySetLastError(ERROR_INVALID_HANDLE);
+        return 0;
+    }
+    return res->size;
+}
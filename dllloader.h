@@ -2,9 +2,10 @@
 #define __DLLLOADER__H__
 
 #include <util/wintypes.h>
+#include <stdio.h>
 #ifndef _WIN32
-typedef uint32_t HANDLE;
-typedef uint32_t HMODULE;
+typedef uintptr_t HANDLE;
+typedef uintptr_t HMODULE;
 typedef uint32_t DWORD;
 typedef int (*FARPROC)();
 typedef uint8_t   BYTE;
@@ -13,6 +14,18 @@ typedef uint16_t WORD;
 typedef void* LPVOID;
 typedef const void* LPCVOID;
 typedef void VOID;
+typedef void* HRSRC;
+typedef void* HGLOBAL;
+
+// calling conventions used by dll code: on x86_64 everything
+// uses the windows x64 convention
+#ifdef __x86_64__
+#define WINAPI  __attribute__((ms_abi))
+#define WINAPIV __attribute__((ms_abi))
+#else
+#define WINAPI  __attribute__((stdcall))
+#define WINAPIV __attribute__((cdecl))
+#endif
 #endif
 
 #define NULLMODULE  HMODULE(0)
@@ -25,13 +38,162 @@ HMODULE MyLoadLibrary(const char*dllname);
 #ifdef _WIN32_WCE
 HMODULE MyLoadKernelLibrary(const char*dllname);
 #endif
+// load from a complete dll image in memory, the buffer is not needed after the call
+HMODULE MyLoadLibraryFromMemory(const void *image, size_t size);
+#ifndef _WIN32
+// load from an open file, page aligned sections are mapped copy-on-write, as with
+// MyLoadLibrary: the file must not be truncated or rewritten in place while the
+// dll is loaded, that raises SIGBUS when its code runs. replace it by a rename.
+// the descriptor is dup'ed, its file offset is not changed
+HMODULE MyLoadLibraryFromFd(int fd);
+// loads into memory supplied by the caller, like a hugepage arena or a shared memory
+// segment, which must be page aligned, and executable when the dll has code to run.
+// the image is relocated for 'dest', and the sections are read directly into it.
+// 'used' receives the size of the image in whole pages, so modules can be packed
+// one after another. when 'size' is too small, this fails with ERROR_INSUFFICIENT_BUFFER,
+// and 'used' receives the size needed. freeing the module leaves the memory to the caller.
+HMODULE MyLoadLibraryAt(const char*dllname, void *dest, size_t size, size_t *used);
+// shares the relocated image between processes: the first process loading the dll
+// puts it in shared memory ( /dev/shm/'shmname' ), the others map it copy-on-write
+// at the same address, and only bind the imports.
+// with shmname NULL, the name is derived from the dll file.
+// when the image cannot be shared, the dll is loaded privately.
+HMODULE MyLoadSharedLibrary(const char*dllname, const char*shmname);
+#endif
+// starts loading in the background, and returns the handle immediately.
+// the other functions taking this handle wait until the load has finished.
+// the handle must be freed, also when loading failed.
+HMODULE MyLoadLibraryAsync(const char*dllname);
+// waits for a background load, returns false when it failed, with the lasterror set
+bool MyWaitLibrary(HMODULE hModule);
 FARPROC MyGetProcAddress(HMODULE hModule, const char*procname);
+// GetProcAddress guesses that 'procname' values below 0x1000 are ordinals, this does not guess
+FARPROC MyGetProcAddressByOrdinal(HMODULE hModule, unsigned ordinal);
+
+struct MyProcRequest {
+    const char *name;       // NULL: look up 'ordinal'
+    unsigned ordinal;
+    FARPROC proc;           // the result, NULL when the dll does not export it
+};
+// resolves all requests in one call, returns the number found.
+// each missing export has a NULL proc, the lasterror is only set for an invalid handle.
+unsigned MyGetProcAddresses(HMODULE hModule, struct MyProcRequest *requests, unsigned count);
+
+// the export address table, in ordinal order: procs[i] is ordinal base+i, and
+// names[i] its name, or NULL when it is exported by ordinal only.
+// forwarders and unused ordinals have a NULL proc.
+// the arrays stay valid until the dll is freed, the procs are never profiling trampolines.
+struct MyExportTable {
+    unsigned base;
+    unsigned count;
+    const FARPROC *procs;
+    const char *const *names;
+};
+bool MyGetExportTable(HMODULE hModule, struct MyExportTable *table);
+
+// resources, the data is returned straight from the loaded image.
+// names and types are strings, MAKEINTRESOURCE(id) or "#id"
+HRSRC MyFindResource(HMODULE hModule, const char *name, const char *type);
+HRSRC MyFindResourceEx(HMODULE hModule, const char *type, const char *name, WORD lang);
+HGLOBAL MyLoadResource(HMODULE hModule, HRSRC hResInfo);
+LPVOID MyLockResource(HGLOBAL hResData);
+DWORD MySizeofResource(HMODULE hModule, HRSRC hResInfo);
+
+// where MyLoadLibrary looks for dlls, ':' or ';' separated.
+// NULL restores the default: the executable's directory, the current directory, then PATH.
+void MySetDllSearchPath(const char *path);
+struct MyDllSearchStats {
+    uint64_t lookups;
+    uint64_t cachehits;     // resolved from the cache
+    uint64_t negativehits;  // 'not found' from the cache
+    uint64_t stats;         // stat calls issued
+    uint64_t invalidations; // cache drops, due to changes in the search directories
+};
+void MyGetDllSearchStats(struct MyDllSearchStats *stats);
 bool MyFreeLibrary(HMODULE hModule);
 
+// retention: MyFreeLibrary keeps modules loaded by MyLoadLibrary in memory, and the
+// next MyLoadLibrary of the same, unchanged, file revives them without loading.
+// a revived module keeps the state of its data, as if it had not been freed.
+// the least recently freed are evicted when the retained images exceed 'budget'
+// bytes, or when they were idle longer than 'idlemsec', 0 meaning no timeout.
+// a budget of 0, the default, disables retention, and evicts all retained modules.
+void MySetModuleRetention(uint64_t budget, unsigned idlemsec);
+struct MyRetentionStats {
+    uint64_t retained;      // modules currently retained
+    uint64_t retainedbytes; // their image size
+    uint64_t revivals;      // loads served from the retained modules
+    uint64_t evictions;     // over the budget
+    uint64_t expirations;   // idle too long
+};
+void MyGetRetentionStats(struct MyRetentionStats *stats);
+
+// dlls are placed at their preferred base address when that range is free,
+// and then need no relocation.
+struct MyModuleInfo {
+    const char *name;
+    uint64_t base;
+    uint64_t size;
+    uint64_t preferredbase;
+    bool relocated;         // false: loaded at the preferred base
+    unsigned fixups;        // relocations applied by this process
+    bool shared;            // mapped from, or published as a shared image
+    // released after loading:
+    uint64_t discarded;     // resident bytes of discardable sections, like .reloc
+    uint64_t metadatafreed; // parsed import, export and relocation lists
+    unsigned replicas;      // per node copies of the code, see MyEnableNumaReplicas
+};
+bool MyGetModuleInfo(HMODULE hModule, struct MyModuleInfo *info);
+
+// call profiling: while enabled, GetProcAddress returns a trampoline which counts
+// the calls of the export, and measures their duration in cycles ( rdtsc ).
+// when disabled GetProcAddress returns the export itself.
+void MyEnableProfiling(bool enable);
+
+// numa: dlls loaded while this is enabled keep a copy of their code and read-only
+// data on each node, their writable data stays shared by all copies.
+// GetProcAddress returns the export in the copy of the calling thread's node.
+// on a single node machine, or when the image cannot be split, nothing is copied.
+// the exports of different copies do not compare equal, MyGetExportTable lists the first.
+void MyEnableNumaReplicas(bool enable);
+// replaces the topology from /sys/devices/system/node, for testing.
+// 'nodes' has the cpu list of each node, separated by ';', like "0-3;4-7".
+// NULL reads the system topology again.
+bool MySetNumaTopology(const char *nodes);
+// pins the calling thread to a node for the copy selection, -1 uses the cpu's node
+void MySetThreadNumaNode(int node);
+
+#define MYPROFILE_BUCKETS 40
+struct MyProcProfile {
+    const char *name;       // NULL when obtained by ordinal
+    unsigned ordinal;
+    FARPROC proc;           // the real export
+    uint64_t calls;
+    uint64_t cycles;        // total over all timed calls
+    uint64_t histogram[MYPROFILE_BUCKETS]; // [b]: calls taking 2^b .. 2^(b+1) cycles
+};
+// returns the number of profiled exports stored in 'stats'
+unsigned MyGetProfile(HMODULE hModule, struct MyProcProfile *stats, unsigned maxcount);
+bool MyDumpProfile(HMODULE hModule, FILE *f);
+
+// write /tmp/perf-<pid>.map entries for the exports and sections of all loaded
+// dlls, so 'perf report' can symbolize samples in dll code.
+// entries are appended when a dll is loaded and kept after it is freed, perf
+// report needs them for the samples taken before.
+void MyEnablePerfMap(bool enable);
+
+// builtin SIGPROF sampling profiler, attributes samples to dll!export
+bool MyStartSampler(unsigned hz);
+void MyStopSampler();
+void MyDumpSamples(FILE *f);
+
 #define ERROR_INVALID_HANDLE             6L
 #define ERROR_GEN_FAILURE                31L
+#define ERROR_INVALID_PARAMETER          87L
+#define ERROR_INSUFFICIENT_BUFFER        122L
 #define ERROR_MOD_NOT_FOUND              126L
 #define ERROR_PROC_NOT_FOUND             127L
+#define ERROR_RESOURCE_NAME_NOT_FOUND    1814L
 void MySetLastError(unsigned err);
 unsigned MyGetLastError();
 
@@ -41,9 +203,24 @@ unsigned MyGetLastError();
 
 #ifndef _WIN32
 #define LoadLibrary MyLoadLibrary
+#define LoadLibraryFromMemory MyLoadLibraryFromMemory
+#define LoadLibraryFromFd MyLoadLibraryFromFd
+#define LoadLibraryAt MyLoadLibraryAt
+#define LoadSharedLibrary MyLoadSharedLibrary
+#define LoadLibraryAsync MyLoadLibraryAsync
+#define WaitLibrary MyWaitLibrary
 #define LoadKernelLibrary MyLoadKernelLibrary
 #define GetProcAddress MyGetProcAddress
+#define GetProcAddressByOrdinal MyGetProcAddressByOrdinal
 #define FreeLibrary MyFreeLibrary
+#define FindResource MyFindResource
+#define FindResourceEx MyFindResourceEx
+#define LoadResource MyLoadResource
+#define LockResource MyLockResource
+#define SizeofResource MySizeofResource
+#ifndef MAKEINTRESOURCE
+#define MAKEINTRESOURCE(i) ((const char*)(uintptr_t)(uint16_t)(i))
+#endif
 #define SetLastError MySetLastError
 #define GetLastError MyGetLastError
 #endif
@@ -0,0 +1,70 @@
+#ifndef __DLLPROC__H__
+#define __DLLPROC__H__
+
+// typed GetProcAddress:
+//
+//   Proc<DWORD(LPBYTE,DWORD,LPBYTE,DWORD,WORD,DWORD)> comp(hDll, "CECompress");
+//   if (!comp) ...
+//   DWORD n= comp(src, srclen, dst, dstlen, 1, 4096);
+//
+// the calling convention is part of the pointer type, so the compiler
+// emits the right call sequence, calling through a Proc is exactly
+// one indirect call, the same as calling through a casted FARPROC.
+
+#ifdef _USE_WINDOWS
+#include <windows.h>
+#else
+#include "dllloader.h"
+#endif
+
+// calling convention tags
+struct Cdecl { };
+struct Stdcall { };
+
+// functions the dll calls back into ( like alloc callbacks ).
+// 32 bit windows code only keeps the stack 4 byte aligned, so on i386
+// these have to realign, x64 code always calls with an aligned stack.
+#if defined(__GNUC__) && defined(__i386__)
+#define DLLCALLBACK __attribute__((force_align_arg_pointer))
+#else
+#define DLLCALLBACK
+#endif
+
+template<typename CC, typename R, typename... A> struct procpointer;
+template<typename R, typename... A> struct procpointer<Cdecl, R, A...> {
+    typedef R (WINAPIV *type)(A...);
+};
+template<typename R, typename... A> struct procpointer<Stdcall, R, A...> {
+    typedef R (WINAPI *type)(A...);
+};
+
+template<typename SIG, typename CC=Cdecl> class Proc;
+
+template<typename CC, typename R, typename... A>
+class Proc<R(A...), CC> {
+public:
+    typedef typename procpointer<CC, R, A...>::type pointer;
+
+    Proc() : _p(0) { }
+    explicit Proc(FARPROC p) : _p(reinterpret_cast<pointer>(p)) { }
+    Proc(HMODULE hModule, const char*procname)
+        : _p(reinterpret_cast<pointer>(GetProcAddress(hModule, procname)))
+    {
+    }
+
+    // returns false, with the lasterror set, when the export was not found
+    bool resolve(HMODULE hModule, const char*procname)
+    {
+        _p= reinterpret_cast<pointer>(GetProcAddress(hModule, procname));
+        return _p!=0;
+    }
+
+    R operator()(A... args) const { return _p(args...); }
+
+    explicit operator bool() const { return _p!=0; }
+    pointer get() const { return _p; }
+private:
+    pointer _p;
+};
+
+#endif
@@ -0,0 +1,259 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+
+#include "dllloader.h"
+
+// generates a header with a struct of typed function pointers for the exports
+// of a dll, and a bind(HMODULE) which fills all of them in one pass over the
+// export table, instead of one GetProcAddress name lookup per export.
+//
+// usage: mkbinding [-n structname] [-s signaturefile] dllname > binding.h
+//
+// the signature file has one export per line:
+//
+//    CECompress   DWORD(const LPBYTE,DWORD,LPBYTE,DWORD,WORD,DWORD)
+//    XPR_DecompressClose  VOID(DWORD)  stdcall
+//    % typedef LPVOID (WINAPIV *FNCompressAlloc)(DWORD);
+//
+// lines starting with '%' are copied to the header as they are, '#' starts a comment.
+// with a signature file only the listed exports are bound, without one all named
+// exports are bound as FARPROC.
+//
+// the dll is loaded to read its exports, so mkbinding has to be built with
+// the same bitness as the dll.
+
+struct signature {
+    signature() : stdcall(false), found(false), ordinal(0) { }
+    std::string type;
+    bool stdcall;
+    bool found;     // set when the dll exports it
+    unsigned ordinal;
+};
+typedef std::map<std::string,signature> signaturemap;
+
+std::string trim(const std::string& s)
+{
+    size_t first= s.find_first_not_of(" \t\r\n");
+    if (first==std::string::npos)
+        return std::string();
+    size_t last= s.find_last_not_of(" \t\r\n");
+    return s.substr(first, last-first+1);
+}
+
+bool readsignatures(const char *filename, signaturemap& sigs, std::vector<std::string>& verbatim)
+{
+    FILE *f= fopen(filename, "r");
+    if (f==NULL) {
+        perror(filename);
+        return false;
+    }
+    char line[1024];
+    unsigned lineno= 0;
+    while (fgets(line, sizeof(line), f)) {
+        lineno++;
+        std::string l= line;
+        if (!l.empty() && l[0]=='%') {
+            verbatim.push_back(trim(l.substr(1)));
+            continue;
+        }
+        l= trim(l.substr(0, l.find('#')));
+        if (l.empty())
+            continue;
+        size_t nameend= l.find_first_of(" \t");
+        if (nameend==std::string::npos) {
+            fprintf(stderr, "%s:%d: missing signature\n", filename, lineno);
+            fclose(f);
+            return false;
+        }
+        signature sig;
+        sig.type= trim(l.substr(nameend));
+        // an optional calling convention follows the closing parenthesis
+        size_t paren= sig.type.rfind(')');
+        if (paren!=std::string::npos && paren+1<sig.type.size()) {
+            std::string cc= trim(sig.type.substr(paren+1));
+            if (cc=="stdcall")
+                sig.stdcall= true;
+            else if (cc!="cdecl") {
+                fprintf(stderr, "%s:%d: unknown calling convention '%s'\n", filename, lineno, cc.c_str());
+                fclose(f);
+                return false;
+            }
+            sig.type= trim(sig.type.substr(0, paren+1));
+        }
+        sigs[l.substr(0, nameend)]= sig;
+    }
+    fclose(f);
+    return true;
+}
+
+// exports like '?open@@YAHXZ' or '_open@4' are not valid c++ names
+std::string identifier(const std::string& name, std::set<std::string>& used)
+{
+    std::string id;
+    for (unsigned i=0 ; i<name.size() ; i++)
+        id += isalnum((unsigned char)name[i]) ? name[i] : '_';
+    if (id.empty() || isdigit((unsigned char)id[0]))
+        id.insert(0, "_");
+    std::string unique= id;
+    for (unsigned n=2 ; used.count(unique) ; n++)
+        unique= id+"_"+std::to_string(n);
+    used.insert(unique);
+    return unique;
+}
+
+std::string guardname(const std::string& structname)
+{
+    std::string guard= "__";
+    for (unsigned i=0 ; i<structname.size() ; i++)
+        guard += toupper((unsigned char)structname[i]);
+    return guard+"__H__";
+}
+
+int main(int argc, char **argv)
+{
+    const char *structname= NULL;
+    const char *sigfile= NULL;
+    const char *dllname= NULL;
+    for (int i=1 ; i<argc ; i++) {
+        if (strcmp(argv[i], "-n")==0 && i+1<argc)
+            structname= argv[++i];
+        else if (strcmp(argv[i], "-s")==0 && i+1<argc)
+            sigfile= argv[++i];
+        else if (argv[i][0]!='-' && dllname==NULL)
+            dllname= argv[i];
+        else {
+            fprintf(stderr, "usage: mkbinding [-n structname] [-s signaturefile] dllname\n");
+            return 1;
+        }
+    }
+    if (dllname==NULL) {
+        fprintf(stderr, "usage: mkbinding [-n structname] [-s signaturefile] dllname\n");
+        return 1;
+    }
+
+    signaturemap sigs;
+    std::vector<std::string> verbatim;
+    if (sigfile && !readsignatures(sigfile, sigs, verbatim))
+        return 1;
+
+    HMODULE hDll= LoadLibrary(dllname);
+    if (hDll==NULLMODULE) {
+        fprintf(stderr, "ERROR - loadlib(%s): %08x\n", dllname, GetLastError());
+        return 1;
+    }
+    MyExportTable table;
+    if (!MyGetExportTable(hDll, &table)) {
+        fprintf(stderr, "ERROR - exporttable: %08x\n", GetLastError());
+        return 1;
+    }
+
+    // the bound exports, in ordinal order
+    std::vector<std::string> names;
+    for (unsigned i=0 ; i<table.count ; i++) {
+        if (table.names[i]==NULL || table.procs[i]==NULL)
+            continue;
+        if (sigfile) {
+            signaturemap::iterator s= sigs.find(table.names[i]);
+            if (s==sigs.end())
+                continue;
+            (*s).second.found= true;
+            (*s).second.ordinal= table.base+i;
+        }
+        else {
+            sigs[table.names[i]].found= true;
+            sigs[table.names[i]].ordinal= table.base+i;
+        }
+        names.push_back(table.names[i]);
+    }
+    bool missing= false;
+    for (signaturemap::iterator s= sigs.begin() ; s!=sigs.end() ; ++s)
+        if (!(*s).second.found) {
+            fprintf(stderr, "ERROR - %s does not export %s\n", dllname, (*s).first.c_str());
+            missing= true;
+        }
+    if (missing)
+        return 1;
+    if (names.empty()) {
+        fprintf(stderr, "ERROR - no exports to bind\n");
+        return 1;
+    }
+
+    std::string basename= dllname;
+    basename= basename.substr(basename.find_last_of("/\\")+1);
+    std::set<std::string> used;
+    std::string defaultname= identifier(basename.substr(0, basename.find('.')), used)+"Dll";
+    if (structname==NULL)
+        structname= defaultname.c_str();
+
+    used.clear();
+    used.insert("bind");
+    std::vector<std::string> slots;
+    for (unsigned i=0 ; i<names.size() ; i++)
+        slots.push_back(identifier(names[i], used));
+
+    printf("// generated by mkbinding from %s, do not edit\n", basename.c_str());
+    printf("#ifndef %s\n", guardname(structname).c_str());
+    printf("#define %s\n", guardname(structname).c_str());
+    printf("\n");
+    printf("#include <string.h>\n");
+    printf("#include \"dllproc.h\"\n");
+    printf("\n");
+    for (unsigned i=0 ; i<verbatim.size() ; i++)
+        printf("%s\n", verbatim[i].c_str());
+    if (!verbatim.empty())
+        printf("\n");
+
+    printf("struct %s {\n", structname);
+    for (unsigned i=0 ; i<names.size() ; i++) {
+        const signature& sig= sigs[names[i]];
+        if (sig.type.empty())
+            printf("    FARPROC %s;\n", slots[i].c_str());
+        else
+            printf("    Proc<%s%s> %s;\n", sig.type.c_str(), sig.stdcall ? ", Stdcall" : "", slots[i].c_str());
+    }
+    printf("\n");
+    printf("    // fills all slots, returns false when an export is missing\n");
+    printf("    bool bind(HMODULE hModule)\n");
+    printf("    {\n");
+    printf("        static const struct { unsigned ordinal; const char *name; } exports[%u]= {\n", unsigned(names.size()));
+    for (unsigned i=0 ; i<names.size() ; i++)
+        printf("            { %u, \"%s\" },\n", sigs[names[i]].ordinal, names[i].c_str());
+    printf("        };\n");
+    printf("        FARPROC procs[%u];\n", unsigned(names.size()));
+    printf("        bool ok= true;\n");
+    printf("#ifndef _USE_WINDOWS\n");
+    printf("        MyExportTable table;\n");
+    printf("        if (!MyGetExportTable(hModule, &table))\n");
+    printf("            return false;\n");
+    printf("        for (unsigned i=0 ; i<%u ; i++) {\n", unsigned(names.size()));
+    printf("            // by ordinal, as long as it still has the same name\n");
+    printf("            unsigned idx= exports[i].ordinal-table.base;\n");
+    printf("            if (idx<table.count && table.names[idx] && strcmp(table.names[idx], exports[i].name)==0)\n");
+    printf("                procs[i]= table.procs[idx];\n");
+    printf("            else\n");
+    printf("                procs[i]= GetProcAddress(hModule, exports[i].name);\n");
+    printf("            ok= ok && procs[i];\n");
+    printf("        }\n");
+    printf("#else\n");
+    printf("        for (unsigned i=0 ; i<%u ; i++) {\n", unsigned(names.size()));
+    printf("            procs[i]= GetProcAddress(hModule, exports[i].name);\n");
+    printf("            ok= ok && procs[i];\n");
+    printf("        }\n");
+    printf("#endif\n");
+    for (unsigned i=0 ; i<names.size() ; i++)
+        printf("        %s= decltype(%s)(procs[%u]);\n", slots[i].c_str(), slots[i].c_str(), i);
+    printf("        return ok;\n");
+    printf("    }\n");
+    printf("};\n");
+    printf("\n");
+    printf("#endif\n");
+
+    FreeLibrary(hDll);
+    return 0;
+}
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <string>
 #include <vector>
 
@@ -8,25 +9,15 @@
 // gobjdump -D -m i386 -b binary --start-address=$[0x1000] --stop-address=$[0x6935] CECompressv4.dll
 // gobjdump -D -m i386 -b binary --start-address=$[0x1000] --stop-address=$[0x7030] cecompr_nt.dll
 //
-#ifdef _USE_WINDOWS
-#include <windows.h>
-#else
-#include "dllloader.h"
-#endif
+#include "dllcodec.h"
 
-typedef DWORD (*CECOMPRESS)(const LPBYTE  lpbSrc, DWORD cbSrc, LPBYTE lpbDest, DWORD cbDest, WORD wStep, DWORD dwPagesize);
-typedef DWORD (*CEDECOMPRESS)(const LPBYTE  lpbSrc, DWORD cbSrc, LPBYTE  lpbDest, DWORD cbDest, DWORD dwSkip, WORD wStep, DWORD dwPagesize);
-
-typedef LPVOID (*FNCompressAlloc)(DWORD AllocSize);
-typedef VOID (*FNCompressFree)(LPVOID Address);
-typedef DWORD (*FNCompressOpen)( DWORD dwParam1, DWORD MaxOrigSize, FNCompressAlloc AllocFn, FNCompressFree FreeFn, DWORD dwUnknown);
-typedef DWORD (*FNCompressConvert)( DWORD ConvertStream, LPVOID CompAdr, DWORD CompSize, LPCVOID OrigAdr, DWORD OrigSize); 
-typedef VOID (*FNCompressClose)( DWORD ConvertStream);
+typedef DWORD (WINAPIV *CECOMPRESS)(const LPBYTE  lpbSrc, DWORD cbSrc, LPBYTE lpbDest, DWORD cbDest, WORD wStep, DWORD dwPagesize);
+typedef DWORD (WINAPIV *CEDECOMPRESS)(const LPBYTE  lpbSrc, DWORD cbSrc, LPBYTE  lpbDest, DWORD cbDest, DWORD dwSkip, WORD wStep, DWORD dwPagesize);
 
 bool test_cecomp(const char *dllname)
 {
     HMODULE hDll= LoadLibrary(dllname);
-    if (hDll==NULL) {
+    if (hDll==NULLMODULE) {
         printf("ERROR - loadlib: %08x\n", GetLastError());
         return false;
     }
@@ -71,75 +62,102 @@ bool test_cecomp(const char *dllname)
 }
 
 typedef std::vector<uint8_t> ByteVector;
-bool test_ntcomp(const char *dllname, const std::string& alg, const std::string& dir, const std::string& enc, ByteVector& in, ByteVector &out)
+bool test_ntcomp(const CodecLibrary& lib, CodecLibrary::Algorithm alg, CodecLibrary::Direction dir, ByteVector& in, ByteVector &out)
 {
-    HMODULE hDll= LoadLibrary(dllname);
-    if (hDll==NULL) {
-        printf("ERROR - loadlib: %08x\n", GetLastError());
-        return false;
-    }
-    FNCompressOpen copen= reinterpret_cast<FNCompressOpen>(GetProcAddress(hDll, (alg+"_"+dir+"Open").c_str()));
-    if (copen==NULL) {
-        printf("ERROR - getproc(copen): %08x\n", GetLastError());
-        if (!FreeLibrary(hDll))
-            printf("ERROR - freelib: %08x\n", GetLastError());
+    CodecSession session(lib, alg, dir, 0x2000, 0x10000);
+    if (!session.isopen()) {
+        printf("ERROR - copen: %08x\n", GetLastError());
         return false;
     }
-    FNCompressConvert ccv= reinterpret_cast<FNCompressConvert>(GetProcAddress(hDll, (alg+"_"+dir+enc).c_str()));
-    if (ccv==NULL) {
-        printf("ERROR - getproc(ccv): %08x\n", GetLastError());
-        if (!FreeLibrary(hDll))
-            printf("ERROR - freelib: %08x\n", GetLastError());
+    const uint8_t *res;
+    DWORD ressize;
+    if (!session.convert(&in[0], in.size(), res, ressize)) {
+        printf("ERROR - ccv: %08x\n", GetLastError());
         return false;
     }
-    FNCompressClose cclose= reinterpret_cast<FNCompressClose>(GetProcAddress(hDll, (alg+"_"+dir+"Close").c_str()));
-    if (cclose==NULL) {
-        printf("ERROR - getproc(cclose): %08x\n", GetLastError());
-        if (!FreeLibrary(hDll))
-            printf("ERROR - freelib: %08x\n", GetLastError());
+    printf("ccv: %08x\n", ressize);
+    out.assign(res, res+ressize);
+    return true;
+}
+
+// many small blocks through one open stream per direction
+bool test_ntbatch(const CodecLibrary& lib, CodecLibrary::Algorithm alg, unsigned nblocks, unsigned blocksize)
+{
+    ByteVector data(nblocks*blocksize);
+    for (unsigned i=0 ; i<data.size() ; i++)
+        data[i]= (i*i)^(i>>7);
+    std::vector<CodecSession::block> blocks, comp, decomp;
+    for (unsigned i=0 ; i<nblocks ; i++)
+        blocks.push_back(CodecSession::block(&data[i*blocksize], blocksize));
+
+    CodecSession c(lib, alg, CodecLibrary::Compress, blocksize);
+    CodecSession d(lib, alg, CodecLibrary::Decompress, blocksize);
+    if (!c.convert(blocks, comp) || !d.convert(comp, decomp)) {
+        printf("ERROR - batch: %08x\n", GetLastError());
         return false;
     }
-    printf("calling %s\n", (alg+"_"+dir+"Open").c_str());
-    DWORD stream = copen(0x10000, 0x2000, FNCompressAlloc(malloc), FNCompressFree(free), 0);
-    if (stream==0 || stream==0xFFFFFFFF) {
-        printf("ERROR - copen: %08x\n", GetLastError());
-        if (!FreeLibrary(hDll))
-            printf("ERROR - freelib: %08x\n", GetLastError());
-        return false;
+    size_t compsize= 0;
+    for (unsigned i=0 ; i<nblocks ; i++) {
+        compsize += comp[i].size;
+        if (decomp[i].size!=blocksize || memcmp(decomp[i].data, blocks[i].data, blocksize)) {
+            printf("ERROR - batch: block %d differs\n", i);
+            return false;
+        }
     }
-
-    DWORD cvres= ccv(stream, &out[0], out.size(), &in[0], in.size());
-    cclose(stream);
-    if (cvres==0 || cvres==0xFFFFFFFF) {
-        printf("ERROR - copen: %08x\n", GetLastError());
-        if (!FreeLibrary(hDll))
-            printf("ERROR - freelib: %08x\n", GetLastError());
+    printf("batch: %d blocks, %d -> %d bytes\n", nblocks, unsigned(data.size()), unsigned(compsize));
+    return true;
+}
+// random reads from a page compressed image, compared with the original
+bool test_cereader(const CodecLibrary& lib, unsigned imagesize, unsigned cachepages, unsigned threads)
+{
+    ByteVector image(imagesize);
+    for (unsigned i=0 ; i<imagesize ; i++)
+        image[i]= (i/4096)%3==0 ? uint8_t(i/64) : uint8_t(i*i>>3);
+    ByteVector data;
+    std::vector<CEPageReader::page> index;
+    if (!CEPageReader::compress(lib, &image[0], imagesize, data, index)) {
+        printf("ERROR - cereader compress: %08x\n", GetLastError());
         return false;
     }
-    printf("ccv: %08x\n", cvres);
-    if (!FreeLibrary(hDll)) {
-        printf("ERROR - freelib: %08x\n", GetLastError());
-        return false;
+    CEPageReader reader(lib, &data[0], index, imagesize, cachepages, threads);
+    ByteVector buf(65536);
+    srand(1);
+    for (unsigned i=0 ; i<1000 ; i++) {
+        unsigned ofs= rand()%imagesize;
+        unsigned len= rand()%std::min(unsigned(buf.size()), imagesize-ofs);
+        if (!reader.read(ofs, &buf[0], len) || memcmp(&buf[0], &image[ofs], len)) {
+            printf("ERROR - cereader: read %08x-%08x differs\n", ofs, ofs+len);
+            return false;
+        }
     }
+    printf("cereader: %d -> %d bytes, cache %d pages: hitrate %.2f, %.0f bytes decompressed per read\n",
+            imagesize, unsigned(data.size()), cachepages, reader.stats().hitrate(), reader.stats().bytesperread());
     return true;
 }
 int main(int argc, char **argv)
 {
     //printf("v3 test: %sok\n", test_cecomp("CECompressv3.dll") ? "" : "not ");
     //printf("v4 test: %sok\n", test_cecomp("CECompressv4.dll") ? "" : "not ");
+    CodecLibrary lib(argc>1 ? argv[1] : "cecompr_nt.dll");
+    if (!lib) {
+        printf("ERROR - loadlib: %08x\n", GetLastError());
+        return 1;
+    }
     const char* algorithm[]= { "LZX", "XPR" };
     const char* direction[]= { "Compress", "Decompress" };
-    const char* enc[]= { "Encode", "Decode" };
     for (int ia=0 ; ia<2 ; ia++) {
         std::vector<ByteVector> v(3);
         v[0].resize(512);
-        v[1].resize(512);
-        v[2].resize(512);
         for (unsigned i=0 ; i<512 ; i++)
             v[0][i]=i*i;
         for (int id=0 ; id<2 ; id++) {
-            printf("nt test: %s %s %sok\n", algorithm[ia], direction[id], test_ntcomp("cecompr_nt.dll", algorithm[ia], direction[id], enc[id], v[id], v[id+1]) ? "" : "not ");
+            printf("nt test: %s %s %sok\n", algorithm[ia], direction[id], test_ntcomp(lib, CodecLibrary::Algorithm(ia), CodecLibrary::Direction(id), v[id], v[id+1]) ? "" : "not ");
         }
         printf("\n\n ... %lu\n\n", v[2].size());
+        printf("nt batch: %s %sok\n", algorithm[ia], test_ntbatch(lib, CodecLibrary::Algorithm(ia), 64, 256) ? "" : "not ");
+    }
+    if (lib.supports(CodecLibrary::CE, CodecLibrary::Compress) && lib.supports(CodecLibrary::CE, CodecLibrary::Decompress)) {
+        printf("ce reader: %sok\n", test_cereader(lib, 1000000, 64, 4) ? "" : "not ");
+        printf("ce reader uncached: %sok\n", test_cereader(lib, 1000000, 0, 0) ? "" : "not ");
     }
 }
@@ -7,12 +7,13 @@
 #include <windows.h>
 #else
 #include "dllloader.h"
+#include <sys/mman.h>
 #endif
 
 bool loaddll(const char *dllname)
 {
     HMODULE hDll= LoadLibrary(dllname);
-    if (hDll==NULL) {
+    if (hDll==NULLMODULE) {
         printf("ERROR - loadlib: %08x\n", GetLastError());
         return false;
     }
@@ -22,9 +23,163 @@ bool loaddll(const char *dllname)
     }
     return true;
 }
+#ifndef _USE_WINDOWS
+// loads all dlls packed one after another in a single mapping
+bool loadarena(int n, char **dllnames)
+{
+    size_t size= 256*1024*1024;
+    uint8_t *arena= (uint8_t*)mmap(NULL, size, PROT_READ|PROT_WRITE|PROT_EXEC, MAP_PRIVATE|MAP_ANON|MAP_NORESERVE, -1, 0);
+    if (arena==MAP_FAILED) {
+        printf("ERROR - mmap arena\n");
+        return false;
+    }
+    std::vector<HMODULE> dlls;
+    size_t pos= 0;
+    for (int i=0 ; i<n ; i++) {
+        size_t used;
+        HMODULE hDll= LoadLibraryAt(dllnames[i], arena+pos, size-pos, &used);
+        if (hDll==NULLMODULE) {
+            printf("ERROR - loadlib %s: %08x\n", dllnames[i], GetLastError());
+            continue;
+        }
+        printf("%s at arena+%08x, %08x bytes\n", dllnames[i], unsigned(pos), unsigned(used));
+        dlls.push_back(hDll);
+        pos += used;
+    }
+    for (unsigned i=0 ; i<dlls.size() ; i++)
+        if (!FreeLibrary(dlls[i]))
+            printf("ERROR - freelib: %08x\n", GetLastError());
+    munmap(arena, size);
+    return dlls.size()==unsigned(n);
+}
+// replicates a dll on two simulated numa nodes, the exports of the nodes should
+// differ. 'counter', an export returning an incremented counter, checks that the
+// nodes share the data. 'adder', an export returning a+b+counter, which reads the
+// counter through a pointer in the data, checks the pointers in the shared pages.
+typedef int (WINAPIV *COUNTER)();
+typedef int (WINAPIV *ADDER)(int a, int b);
+bool loadreplicated(const char *dllname, const char *counter, const char *adder)
+{
+    MySetNumaTopology("0;1");
+    MyEnableNumaReplicas(true);
+    HMODULE hDll= LoadLibrary(dllname);
+    MyEnableNumaReplicas(false);
+    MySetNumaTopology(NULL);
+    if (hDll==NULLMODULE) {
+        printf("ERROR - loadlib: %08x\n", GetLastError());
+        return false;
+    }
+    bool ok= true;
+    MyModuleInfo info;
+    MyGetModuleInfo(hDll, &info);
+    MyExportTable table;
+    MyGetExportTable(hDll, &table);
+    for (unsigned i=0 ; i<table.count ; i++) {
+        if (table.procs[i]==NULL)
+            continue;
+        MySetThreadNumaNode(0);
+        FARPROC p0= GetProcAddressByOrdinal(hDll, table.base+i);
+        MySetThreadNumaNode(1);
+        FARPROC p1= GetProcAddressByOrdinal(hDll, table.base+i);
+        if (p0==p1) {
+            printf("ERROR - export %d is at %p on both nodes\n", table.base+i, (void*)p0);
+            ok= false;
+        }
+    }
+    if (counter) {
+        MySetThreadNumaNode(0);
+        COUNTER c0= (COUNTER)GetProcAddress(hDll, counter);
+        MySetThreadNumaNode(1);
+        COUNTER c1= (COUNTER)GetProcAddress(hDll, counter);
+        if (c0==NULL || c1==NULL) {
+            printf("ERROR - getproc(%s): %08x\n", counter, GetLastError());
+            ok= false;
+        }
+        else {
+            int v0= c0();
+            int v1= c1();
+            if (v1!=v0+1) {
+                printf("ERROR - %s returned %d on node 0, and %d on node 1\n", counter, v0, v1);
+                ok= false;
+            }
+            for (int node=0 ; adder && node<2 ; node++) {
+                MySetThreadNumaNode(node);
+                ADDER a= (ADDER)GetProcAddress(hDll, adder);
+                int sum= a ? a(1, 2) : -1;
+                if (sum!=3+v1) {
+                    printf("ERROR - %s returned %d on node %d, expected %d\n", adder, sum, node, 3+v1);
+                    ok= false;
+                }
+            }
+        }
+    }
+    MySetThreadNumaNode(-1);
+    printf("%s: %d replicas, %d exports\n", dllname, info.replicas, table.count);
+    if (!FreeLibrary(hDll)) {
+        printf("ERROR - freelib: %08x\n", GetLastError());
+        return false;
+    }
+    return ok && info.replicas==2;
+}
+// 'getter' is an export looking up resource 'name' of its own dll, with its image
+// base ( &__ImageBase ) as the instance handle. the second load is relocated.
+typedef const char *(WINAPIV *GETRESOURCE)(const char *name);
+bool loadresource(const char *dllname, const char *getter, const char *name)
+{
+    HMODULE hDll[2];
+    bool ok= true;
+    for (int i=0 ; i<2 ; i++) {
+        hDll[i]= LoadLibrary(dllname);
+        if (hDll[i]==NULLMODULE) {
+            printf("ERROR - loadlib: %08x\n", GetLastError());
+            return false;
+        }
+        GETRESOURCE get= (GETRESOURCE)GetProcAddress(hDll[i], getter);
+        const char *res= get ? get(name) : NULL;
+        if (res==NULL) {
+            printf("ERROR - %s(%s): %08x\n", getter, name, GetLastError());
+            ok= false;
+        }
+        else {
+            printf("%s: %s\n", name, res);
+        }
+    }
+    for (int i=0 ; i<2 ; i++)
+        FreeLibrary(hDll[i]);
+    return ok;
+}
+#endif
 int main(int argc, char **argv)
 {
-    for (int i=1 ; i<argc ; i++)
+#ifndef _USE_WINDOWS
+    // -a: load all dlls into one arena
+    if (argc>1 && std::string(argv[1])=="-a")
+        return loadarena(argc-2, argv+2) ? 0 : 1;
+    // -n dll [counter [adder]]: replicate the dll on two simulated numa nodes
+    if (argc>2 && std::string(argv[1])=="-n")
+        return loadreplicated(argv[2], argc>3 ? argv[3] : NULL, argc>4 ? argv[4] : NULL) ? 0 : 1;
+    // -R dll getter name: a dll finds its own resource through its image base
+    if (argc>4 && std::string(argv[1])=="-R")
+        return loadresource(argv[2], argv[3], argv[4]) ? 0 : 1;
+#endif
+    // -r: retain freed dlls, and load each dll twice, the second load should revive it
+    bool retain= argc>1 && std::string(argv[1])=="-r";
+#ifndef _USE_WINDOWS
+    if (retain)
+        MySetModuleRetention(256*1024*1024, 10000);
+#endif
+    for (int i=retain ? 2 : 1 ; i<argc ; i++) {
         loaddll(argv[i]);
+        if (retain)
+            loaddll(argv[i]);
+    }
+#ifndef _USE_WINDOWS
+    if (retain) {
+        MyRetentionStats stats;
+        MyGetRetentionStats(&stats);
+        printf("retained %d modules, %d bytes, revived %d, evicted %d, expired %d\n",
+                int(stats.retained), int(stats.retainedbytes), int(stats.revivals), int(stats.evictions), int(stats.expirations));
+    }
+#endif
     return 0;
 }
@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <chrono>
+
+#include "dllproc.h"
+
+// compares calling through a casted FARPROC with calling through Proc<>
+//
+// usage: tstproc [CECompress-dll]
+//
+// the local test measures just the call overhead, the dll test
+// calls CECompress on a small buffer.
+
+typedef DWORD (WINAPIV *CECOMPRESS)(const LPBYTE  lpbSrc, DWORD cbSrc, LPBYTE lpbDest, DWORD cbDest, WORD wStep, DWORD dwPagesize);
+typedef DWORD (WINAPIV *ADDPROC)(DWORD a, DWORD b);
+
+DWORD WINAPIV localadd(DWORD a, DWORD b) { return a+b; }
+
+// volatile, so the compiler cannot see through the pointer and inline the call
+FARPROC volatile g_localadd= reinterpret_cast<FARPROC>(localadd);
+
+typedef std::chrono::steady_clock benchclock;
+
+double nsecpercall(benchclock::time_point t0, benchclock::time_point t1, unsigned n)
+{
+    return std::chrono::duration<double, std::nano>(t1-t0).count()/n;
+}
+
+void bench_local(unsigned n)
+{
+    ADDPROC raw= reinterpret_cast<ADDPROC>(g_localadd);
+    DWORD sum= 0;
+    benchclock::time_point t0= benchclock::now();
+    for (unsigned i=0 ; i<n ; i++)
+        sum= raw(sum, i);
+    benchclock::time_point t1= benchclock::now();
+
+    Proc<DWORD(DWORD,DWORD)> typed(g_localadd);
+    DWORD tsum= 0;
+    benchclock::time_point t2= benchclock::now();
+    for (unsigned i=0 ; i<n ; i++)
+        tsum= typed(tsum, i);
+    benchclock::time_point t3= benchclock::now();
+
+    printf("local  raw: %6.2f ns/call   Proc: %6.2f ns/call   %s\n",
+            nsecpercall(t0, t1, n), nsecpercall(t2, t3, n), sum==tsum ? "ok" : "MISMATCH");
+}
+
+bool bench_dll(const char *dllname, unsigned n)
+{
+    HMODULE hDll= LoadLibrary(dllname);
+    if (hDll==NULLMODULE) {
+        printf("ERROR - loadlib: %08x\n", GetLastError());
+        return false;
+    }
+    CECOMPRESS raw= reinterpret_cast<CECOMPRESS>(GetProcAddress(hDll, "CECompress"));
+    Proc<DWORD(const LPBYTE,DWORD,LPBYTE,DWORD,WORD,DWORD)> typed(hDll, "CECompress");
+    if (raw==NULL || !typed) {
+        printf("ERROR - getproc: %08x\n", GetLastError());
+        FreeLibrary(hDll);
+        return false;
+    }
+
+    uint8_t src[64];
+    for (unsigned i=0 ; i<sizeof(src) ; i++)
+        src[i]= i*i;
+    uint8_t dst[64];
+
+    DWORD rawres= 0;
+    benchclock::time_point t0= benchclock::now();
+    for (unsigned i=0 ; i<n ; i++)
+        rawres= raw(src, sizeof(src), dst, sizeof(dst)-1, 1, 4096);
+    benchclock::time_point t1= benchclock::now();
+
+    DWORD typedres= 0;
+    benchclock::time_point t2= benchclock::now();
+    for (unsigned i=0 ; i<n ; i++)
+        typedres= typed(src, sizeof(src), dst, sizeof(dst)-1, 1, 4096);
+    benchclock::time_point t3= benchclock::now();
+
+    printf("dll    raw: %6.2f ns/call   Proc: %6.2f ns/call   %s\n",
+            nsecpercall(t0, t1, n), nsecpercall(t2, t3, n), rawres==typedres ? "ok" : "MISMATCH");
+
+    if (!FreeLibrary(hDll)) {
+        printf("ERROR - freelib: %08x\n", GetLastError());
+        return false;
+    }
+    return true;
+}
+int main(int argc, char **argv)
+{
+    bench_local(100000000);
+    if (argc>1)
+        bench_dll(argv[1], 1000000);
+    return 0;
+}